@@ -1,97 +1,364 @@
-import {
-  bench,
-  runBenchmarks,
-} from "https://deno.land/std@0.53.0/testing/bench.ts";
+import { parse } from "https://deno.land/std@0.53.0/flags/mod.ts";
 import { DB } from "./mod.ts";
 
-const dbFile = Deno.args[0] || ":memory:";
-const db = new DB(dbFile);
+// Usage:
+//   deno run --allow-read --allow-write bench.ts [--json out.json]
+//     [--only <name>] [--backend memory|file]
+//
+// Every benchmark is run against an in-memory and a file
+// backed database. Besides latency percentiles, each result
+// reports file I/O (see `DB.ioStats`) per run, and time spent
+// in file I/O and calls into WASM (see `DB.profile`) of a
+// single profiled run.
 
-db.query(
-  "CREATE TABLE users (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, balance INTEGER)",
-);
+const args = parse(Deno.args);
+const dbFile = "bench.db";
+
+interface Benchmark {
+  name: string;
+  runs: number;
+  // Run once before the timed runs
+  setup?: (db: DB) => void;
+  run: (db: DB, i: number) => void;
+}
+
+interface Result {
+  name: string;
+  backend: string;
+  runs: number;
+  totalMs: number;
+  meanMs: number;
+  p50Ms: number;
+  p90Ms: number;
+  p99Ms: number;
+  maxMs: number;
+  readsPerRun: number;
+  writesPerRun: number;
+  bytesReadPerRun: number;
+  bytesWrittenPerRun: number;
+  syncsPerRun: number;
+  ioMsPerRun: number;
+  callsPerRun: number;
+}
 
-/** Performance of insert statements (1 insert). */
-let n = 0;
 const names = "Deno Land Peter Parker Clark Kent Robert Parr".split(" ");
+const WIDE_COLUMNS = 32;
+const BLOB_SIZE = 1 << 16;
+const blob = new Uint8Array(BLOB_SIZE).map((_, i) => i % 256);
 
-bench({
-  name: "insert (named)",
-  runs: 10_000,
-  func: (b): void => {
-    n = (10 * n) % 10_000;
-    b.start();
-    db.query(
-      "INSERT INTO users (name, balance) VALUES (:name, :balance)",
-      { name: names[n % names.length], balance: n },
-    );
-    b.stop();
-  },
-});
-
-bench({
-  name: "insert (positional)",
-  runs: 10_000,
-  func: (b): void => {
-    n = (10 * n) % 10_000;
-    b.start();
-    db.query(
-      "INSERT INTO users (name, balance) VALUES (?, ?)",
-      [names[n % names.length], n],
-    );
-    b.stop();
-  },
-});
-
-/** Performance of select statements (select + iterate 1000 rows). */
-bench({
-  name: "select",
-  runs: 1000,
-  func: (b): void => {
-    b.start();
-    for (
-      const [name, balance] of db.query(
-        "SELECT name, balance FROM users LIMIT 1000",
-      )
-    ) {
-      continue;
-    }
-    b.stop();
-  },
-});
-
-/** Performance when sorting rows (select and sort 1000 rows). */
-bench({
-  name: "order",
-  runs: 100,
-  func: (b): void => {
-    b.start();
-    for (
-      const [name, balance] of db.query(
-        "SELECT name, balance FROM users ORDER BY balance DESC LIMIT 1000",
-      )
-    ) {
-      continue;
-    }
-    b.stop();
-  },
-});
-
-/** Performance when sorting using random order. */
-bench({
-  name: "random",
-  runs: 100,
-  func: (b): void => {
-    b.start();
-    for (
-      const [name, balance] of db.query(
-        "SELECT name, balance FROM users ORDER BY RANDOM() LIMIT 1000",
-      )
-    ) {
-      continue;
-    }
-    b.stop();
+function usersTable(db: DB) {
+  db.query(
+    "CREATE TABLE IF NOT EXISTS users (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, balance INTEGER)",
+  );
+}
+
+function fillUsers(db: DB, count: number) {
+  usersTable(db);
+  const rows = [];
+  for (let i = 0; i < count; i++) {
+    rows.push([names[i % names.length], (i * 7919) % 10_000]);
+  }
+  db.executeMany("INSERT INTO users (name, balance) VALUES (?, ?)", rows);
+}
+
+function drain(rows: Iterable<any[]>) {
+  for (const _ of rows) {
+    continue;
+  }
+}
+
+const benchmarks: Benchmark[] = [
+  /** Performance of single insert statements. */
+  {
+    name: "insert (named)",
+    runs: 1_000,
+    setup: usersTable,
+    run: (db, i) =>
+      db.query(
+        "INSERT INTO users (name, balance) VALUES (:name, :balance)",
+        { name: names[i % names.length], balance: i },
+      ),
+  },
+  {
+    name: "insert (positional)",
+    runs: 1_000,
+    setup: usersTable,
+    run: (db, i) =>
+      db.query(
+        "INSERT INTO users (name, balance) VALUES (?, ?)",
+        [names[i % names.length], i],
+      ),
+  },
+  /** Performance of bulk inserts (1000 rows). */
+  {
+    name: "insert (many)",
+    runs: 100,
+    setup: usersTable,
+    run: (db, i) => {
+      const rows = [];
+      for (let j = 0; j < 1000; j++) {
+        rows.push([names[j % names.length], i * 1000 + j]);
+      }
+      db.executeMany("INSERT INTO users (name, balance) VALUES (?, ?)", rows);
+    },
+  },
+  /** Performance of many inserts in one long transaction (10000 rows). */
+  {
+    name: "transaction",
+    runs: 20,
+    setup: usersTable,
+    run: (db, i) => {
+      db.query("BEGIN");
+      for (let j = 0; j < 10_000; j++) {
+        db.query(
+          "INSERT INTO users (name, balance) VALUES (?, ?)",
+          [names[j % names.length], i * 10_000 + j],
+        );
+      }
+      db.query("COMMIT");
+    },
+  },
+  /** Performance of select statements (select + iterate 1000 rows). */
+  {
+    name: "select",
+    runs: 1_000,
+    setup: (db) => fillUsers(db, 10_000),
+    run: (db, i) =>
+      drain(
+        db.query(
+          "SELECT name, balance FROM users WHERE id > ? LIMIT 1000",
+          [(i * 1000) % 9_000],
+        ),
+      ),
+  },
+  /** Performance when scanning large results (100000 rows). */
+  {
+    name: "scan",
+    runs: 20,
+    setup: (db) => fillUsers(db, 100_000),
+    run: (db) => drain(db.query("SELECT name, balance FROM users")),
+  },
+  {
+    name: "scan (columnar)",
+    runs: 20,
+    setup: (db) => fillUsers(db, 100_000),
+    run: (db) => db.query("SELECT id, balance FROM users").columnar(),
+  },
+  /** Performance when sorting rows (select and sort 1000 rows). */
+  {
+    name: "order",
+    runs: 100,
+    setup: (db) => fillUsers(db, 10_000),
+    run: (db) =>
+      drain(
+        db.query(
+          "SELECT name, balance FROM users ORDER BY balance DESC LIMIT 1000",
+        ),
+      ),
+  },
+  {
+    name: "random",
+    runs: 100,
+    setup: (db) => fillUsers(db, 10_000),
+    run: (db) =>
+      drain(
+        db.query(
+          "SELECT name, balance FROM users ORDER BY RANDOM() LIMIT 1000",
+        ),
+      ),
+  },
+  /** Performance of BLOB heavy workloads (64 KiB values). */
+  {
+    name: "blob (insert)",
+    runs: 500,
+    setup: (db) =>
+      db.query("CREATE TABLE blobs (id INTEGER PRIMARY KEY, data BLOB)"),
+    run: (db) => db.query("INSERT INTO blobs (data) VALUES (?)", [blob]),
   },
-});
+  {
+    name: "blob (select)",
+    runs: 500,
+    setup: (db) => {
+      db.query("CREATE TABLE blobs (id INTEGER PRIMARY KEY, data BLOB)");
+      db.executeMany(
+        "INSERT INTO blobs (data) VALUES (?)",
+        [...Array(100)].map(() => [blob]),
+      );
+    },
+    run: (db, i) =>
+      drain(db.query("SELECT data FROM blobs WHERE id = ?", [i % 100 + 1])),
+  },
+  {
+    name: "blob (handle)",
+    runs: 500,
+    setup: (db) => {
+      db.query("CREATE TABLE blobs (id INTEGER PRIMARY KEY, data BLOB)");
+      db.executeMany(
+        "INSERT INTO blobs (data) VALUES (?)",
+        [...Array(100)].map(() => [blob]),
+      );
+    },
+    run: (db, i) => {
+      const handle = db.openBlob("blobs", "data", i % 100 + 1);
+      handle.read();
+      handle.close();
+    },
+  },
+  /** Performance with many columns per row. */
+  {
+    name: "wide rows (insert)",
+    runs: 50,
+    setup: (db) => wideTable(db),
+    run: (db, i) => db.executeMany(wideInsert, wideRows(i, 100)),
+  },
+  {
+    name: "wide rows (select)",
+    runs: 50,
+    setup: (db) => {
+      wideTable(db);
+      db.executeMany(wideInsert, wideRows(0, 5000));
+    },
+    run: (db) => drain(db.query("SELECT * FROM wide")),
+  },
+  /** Performance of 64 bit integers, which do not fit a number. */
+  {
+    name: "big ints (insert)",
+    runs: 100,
+    setup: (db) =>
+      db.query("CREATE TABLE bigints (id INTEGER PRIMARY KEY, val INTEGER)"),
+    run: (db, i) =>
+      db.executeMany(
+        "INSERT INTO bigints (val) VALUES (?)",
+        [...Array(1000)].map((_, j) => [
+          9007199254740993n * BigInt(i * 1000 + j + 1),
+        ]),
+      ),
+  },
+  {
+    name: "big ints (select)",
+    runs: 50,
+    setup: (db) => {
+      db.query("CREATE TABLE bigints (id INTEGER PRIMARY KEY, val INTEGER)");
+      db.executeMany(
+        "INSERT INTO bigints (val) VALUES (?)",
+        [...Array(10_000)].map((_, j) => [9007199254740993n * BigInt(j + 1)]),
+      );
+    },
+    run: (db) => drain(db.query("SELECT val FROM bigints")),
+  },
+];
+
+const wideInsert = `INSERT INTO wide VALUES (${
+  [...Array(WIDE_COLUMNS)].map(() => "?").join(", ")
+})`;
+
+function wideTable(db: DB) {
+  const columns = [...Array(WIDE_COLUMNS)].map((_, c) =>
+    c % 2 ? `c${c} TEXT` : `c${c} INTEGER`
+  );
+  db.query(`CREATE TABLE wide (${columns.join(", ")})`);
+}
+
+function wideRows(seed: number, count: number) {
+  return [...Array(count)].map((_, r) =>
+    [...Array(WIDE_COLUMNS)].map((_, c) =>
+      c % 2 ? `${names[(r + c) % names.length]} ${seed}` : seed * count + r
+    )
+  );
+}
+
+function percentile(sorted: number[], p: number): number {
+  const idx = Math.min(sorted.length - 1, Math.floor(sorted.length * p));
+  return sorted[idx];
+}
+
+function removeDbFile() {
+  for (const path of [dbFile, `${dbFile}-journal`]) {
+    try {
+      Deno.removeSync(path);
+    } catch {
+      /* no op */
+    }
+  }
+}
+
+function runBenchmark(bench: Benchmark, backend: string): Result {
+  removeDbFile();
+  const db = new DB(backend === "file" ? dbFile : ":memory:");
+  bench.setup?.(db);
+
+  // Count calls and time file I/O of a single, untimed
+  // run, since profiling slows everything down
+  db.ioStats(true);
+  db.profile(true);
+  bench.run(db, 0);
+  db.profile(false);
+  const ioMs = db.ioStats().ioTime;
+  let calls = 0;
+  for (const count of db.callStats().values()) {
+    calls += count;
+  }
+
+  db.ioStats(true);
+  const samples = [];
+  const start = performance.now();
+  for (let i = 1; i <= bench.runs; i++) {
+    const runStart = performance.now();
+    bench.run(db, i);
+    samples.push(performance.now() - runStart);
+  }
+  const totalMs = performance.now() - start;
+  const io = db.ioStats();
+  db.close();
+  removeDbFile();
+
+  samples.sort((a, b) => a - b);
+  return {
+    name: bench.name,
+    backend,
+    runs: bench.runs,
+    totalMs,
+    meanMs: totalMs / bench.runs,
+    p50Ms: percentile(samples, 0.5),
+    p90Ms: percentile(samples, 0.9),
+    p99Ms: percentile(samples, 0.99),
+    maxMs: samples[samples.length - 1],
+    readsPerRun: io.reads / bench.runs,
+    writesPerRun: io.writes / bench.runs,
+    bytesReadPerRun: io.readBytes / bench.runs,
+    bytesWrittenPerRun: io.writeBytes / bench.runs,
+    syncsPerRun: io.syncs / bench.runs,
+    ioMsPerRun: ioMs,
+    callsPerRun: calls,
+  };
+}
+
+const backends = args.backend ? [args.backend] : ["memory", "file"];
+const results: Result[] = [];
+for (const bench of benchmarks) {
+  if (args.only && !bench.name.includes(args.only)) {
+    continue;
+  }
+  for (const backend of backends) {
+    const result = runBenchmark(bench, backend);
+    results.push(result);
+    console.log(
+      `${`${result.name} [${backend}]`.padEnd(32)} ` +
+        `mean ${result.meanMs.toFixed(3)}ms, ` +
+        `p50 ${result.p50Ms.toFixed(3)}ms, ` +
+        `p90 ${result.p90Ms.toFixed(3)}ms, ` +
+        `p99 ${result.p99Ms.toFixed(3)}ms | ` +
+        `io ${result.ioMsPerRun.toFixed(3)}ms, ` +
+        `${result.readsPerRun.toFixed(1)} reads, ` +
+        `${result.writesPerRun.toFixed(1)} writes, ` +
+        `${result.callsPerRun} calls per run`,
+    );
+  }
+}
 
-runBenchmarks();
+if (args.json) {
+  await Deno.writeFile(
+    args.json,
+    new TextEncoder().encode(JSON.stringify(results, null, 2)),
+  );
+}
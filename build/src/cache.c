@@ -0,0 +1,399 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include "cache.h"
+#include "debug.h"
+#include "stats.h"
+
+// Block cache for the Deno VFS.
+//
+// Reads are served from cached blocks. When blocks are read
+// sequentially, up to CACHE_READ_AHEAD blocks are loaded with
+// a single js_read. Writes only go to the cache and are written
+// back when the cache is flushed (on xSync, when unlocking the
+// file, or when a dirty block is evicted). On flush, adjacent
+// dirty blocks are coalesced into a single js_write.
+//
+// WAL files are never locked and, with synchronous=NORMAL, only
+// synced on checkpoints. Their caches are write-through, so that
+// committed transactions are not held back in memory.
+
+#define BUCKET(index) ((unsigned int)(index) & (CACHE_BUCKETS - 1))
+// Number of header bytes compared to detect changes to the file
+#define HEADER_SIZE 100
+
+static CacheBlock* cache_lookup(Cache* cache, sqlite3_int64 index) {
+  for (CacheBlock* block = cache->buckets[BUCKET(index)]; block; block = block->chain) {
+    if (block->index == index)
+      return block;
+  }
+  return NULL;
+}
+
+static void lru_unlink(Cache* cache, CacheBlock* block) {
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    cache->head = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  else
+    cache->tail = block->prev;
+  block->prev = NULL;
+  block->next = NULL;
+}
+
+static void lru_push(Cache* cache, CacheBlock* block) {
+  block->prev = NULL;
+  block->next = cache->head;
+  if (cache->head)
+    cache->head->prev = block;
+  else
+    cache->tail = block;
+  cache->head = block;
+}
+
+static void lru_touch(Cache* cache, CacheBlock* block) {
+  if (cache->head != block) {
+    lru_unlink(cache, block);
+    lru_push(cache, block);
+  }
+}
+
+static void hash_insert(Cache* cache, CacheBlock* block) {
+  block->chain = cache->buckets[BUCKET(block->index)];
+  cache->buckets[BUCKET(block->index)] = block;
+}
+
+static void hash_remove(Cache* cache, CacheBlock* block) {
+  CacheBlock** link = &cache->buckets[BUCKET(block->index)];
+  while (*link != block)
+    link = &(*link)->chain;
+  *link = block->chain;
+}
+
+// Remove block from the cache and free it, without
+// writing back any changes.
+static void cache_discard(Cache* cache, CacheBlock* block) {
+  if (block->dirty)
+    cache->dirty --;
+  lru_unlink(cache, block);
+  hash_remove(cache, block);
+  free(block);
+  cache->blocks --;
+}
+
+// Add a new block for index to the cache. If the cache
+// is full, the least recently used block is evicted. The
+// data of the returned block is not initialized.
+static int cache_alloc(Cache* cache, sqlite3_int64 index, CacheBlock** out) {
+  CacheBlock* block;
+  if (cache->blocks < CACHE_BLOCKS) {
+    block = malloc(sizeof(CacheBlock));
+    if (!block)
+      return SQLITE_IOERR_NOMEM;
+    cache->blocks ++;
+  } else {
+    block = cache->tail;
+    if (block->dirty) {
+      int status = cache_flush(cache);
+      if (status != SQLITE_OK)
+        return status;
+    }
+    lru_unlink(cache, block);
+    hash_remove(cache, block);
+  }
+  block->index = index;
+  block->dirty = 0;
+  hash_insert(cache, block);
+  lru_push(cache, block);
+  *out = block;
+  return SQLITE_OK;
+}
+
+// Load count blocks starting at first from the file. None of
+// the blocks may be cached already. Returns the first block.
+static int cache_load(Cache* cache, sqlite3_int64 first, int count, CacheBlock** out) {
+  CacheBlock* blocks[CACHE_READ_AHEAD];
+  for (int i = 0; i < count; i ++) {
+    int status = cache_alloc(cache, first + i, &blocks[i]);
+    if (status != SQLITE_OK) {
+      for (int j = 0; j < i; j ++)
+        cache_discard(cache, blocks[j]);
+      return status;
+    }
+  }
+
+  sqlite3_int64 offset = first * CACHE_BLOCK_SIZE;
+  int amount = count * CACHE_BLOCK_SIZE;
+  if (offset + amount > cache->size)
+    amount = cache->size > offset ? (int)(cache->size - offset) : 0;
+
+  char* buf = count == 1 ? blocks[0]->data : malloc(count * CACHE_BLOCK_SIZE);
+  if (!buf) {
+    for (int i = 0; i < count; i ++)
+      cache_discard(cache, blocks[i]);
+    return SQLITE_IOERR_NOMEM;
+  }
+  int read_bytes = amount > 0 ? io_read(cache->rid, buf, offset, amount) : 0;
+  if (read_bytes < 0)
+    read_bytes = 0;
+  // Anything past the end of the file reads as zeros
+  memset(&buf[read_bytes], 0, count * CACHE_BLOCK_SIZE - read_bytes);
+  if (count > 1) {
+    for (int i = 0; i < count; i ++)
+      memcpy(blocks[i]->data, &buf[i * CACHE_BLOCK_SIZE], CACHE_BLOCK_SIZE);
+    free(buf);
+  }
+  debug_printf("loaded blocks into cache (rid %i, first %lli, count %i, read %i)\n",
+    cache->rid, (long long)first, count, read_bytes);
+
+  cache->last_block = first + count - 1;
+  *out = blocks[0];
+  return SQLITE_OK;
+}
+
+// Return the cached block for index, loading it (and
+// any blocks after it on sequential reads) if needed.
+static int cache_get(Cache* cache, sqlite3_int64 index, CacheBlock** out) {
+  CacheBlock* block = cache_lookup(cache, index);
+  if (block) {
+    lru_touch(cache, block);
+    vfs_stats.cache_hits ++;
+    *out = block;
+    return SQLITE_OK;
+  }
+  vfs_stats.cache_misses ++;
+
+  int count = 1;
+  if (index == cache->last_block + 1) {
+    while (
+      count < CACHE_READ_AHEAD &&
+      (index + count) * CACHE_BLOCK_SIZE < cache->size &&
+      !cache_lookup(cache, index + count)
+    ) {
+      count ++;
+    }
+  }
+  return cache_load(cache, index, count, out);
+}
+
+static int block_cmp(const void* a, const void* b) {
+  sqlite3_int64 ia = (*(CacheBlock**)a)->index;
+  sqlite3_int64 ib = (*(CacheBlock**)b)->index;
+  return ia < ib ? -1 : ia > ib;
+}
+
+void cache_init(Cache* cache, int rid, int write_through) {
+  memset(cache, 0, sizeof(Cache));
+  cache->rid = rid;
+  cache->write_through = write_through;
+  cache->size = io_size(rid);
+  cache->last_block = -2;
+}
+
+void cache_free(Cache* cache) {
+  cache_flush(cache);
+  while (cache->head)
+    cache_discard(cache, cache->head);
+}
+
+int cache_read(Cache* cache, void* buf, int amount, sqlite3_int64 offset) {
+  char* out = (char*)buf;
+  int available = amount;
+  if (offset >= cache->size)
+    available = 0;
+  else if (offset + amount > cache->size)
+    available = (int)(cache->size - offset);
+
+  for (int done = 0; done < available;) {
+    sqlite3_int64 pos = offset + done;
+    int in_block = (int)(pos % CACHE_BLOCK_SIZE);
+    int len = CACHE_BLOCK_SIZE - in_block;
+    if (len > available - done)
+      len = available - done;
+
+    CacheBlock* block;
+    int status = cache_get(cache, pos / CACHE_BLOCK_SIZE, &block);
+    if (status != SQLITE_OK)
+      return status;
+    memcpy(&out[done], &block->data[in_block], len);
+    done += len;
+  }
+
+  // Zero memory if read was short
+  if (available < amount) {
+    memset(&out[available], 0, amount - available);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+// Write to the file directly, updating any cached blocks.
+static int cache_write_through(Cache* cache, const char* in, int amount, sqlite3_int64 offset) {
+  int write_bytes = io_write(cache->rid, in, offset, amount);
+  if (write_bytes != amount)
+    return SQLITE_IOERR_WRITE;
+  if (offset + amount > cache->size)
+    cache->size = offset + amount;
+
+  for (int done = 0; done < amount;) {
+    sqlite3_int64 pos = offset + done;
+    int in_block = (int)(pos % CACHE_BLOCK_SIZE);
+    int len = CACHE_BLOCK_SIZE - in_block;
+    if (len > amount - done)
+      len = amount - done;
+    CacheBlock* block = cache_lookup(cache, pos / CACHE_BLOCK_SIZE);
+    if (block)
+      memcpy(&block->data[in_block], &in[done], len);
+    done += len;
+  }
+  return SQLITE_OK;
+}
+
+int cache_write(Cache* cache, const void* buf, int amount, sqlite3_int64 offset) {
+  const char* in = (const char*)buf;
+  if (cache->write_through)
+    return cache_write_through(cache, in, amount, offset);
+  // Update the size first, so blocks evicted
+  // during this write are flushed completely
+  sqlite3_int64 old_size = cache->size;
+  if (offset + amount > cache->size)
+    cache->size = offset + amount;
+
+  for (int done = 0; done < amount;) {
+    sqlite3_int64 pos = offset + done;
+    sqlite3_int64 index = pos / CACHE_BLOCK_SIZE;
+    int in_block = (int)(pos % CACHE_BLOCK_SIZE);
+    int len = CACHE_BLOCK_SIZE - in_block;
+    if (len > amount - done)
+      len = amount - done;
+
+    int status = SQLITE_OK;
+    CacheBlock* block = cache_lookup(cache, index);
+    if (block) {
+      lru_touch(cache, block);
+    } else if (len == CACHE_BLOCK_SIZE || index * CACHE_BLOCK_SIZE >= old_size) {
+      // No need to read blocks we overwrite or which are past the end
+      status = cache_alloc(cache, index, &block);
+      if (status == SQLITE_OK)
+        memset(block->data, 0, CACHE_BLOCK_SIZE);
+    } else {
+      status = cache_load(cache, index, 1, &block);
+    }
+    if (status != SQLITE_OK)
+      return status;
+
+    memcpy(&block->data[in_block], &in[done], len);
+    if (!block->dirty) {
+      block->dirty = 1;
+      cache->dirty ++;
+    }
+    done += len;
+  }
+  return SQLITE_OK;
+}
+
+int cache_truncate(Cache* cache, sqlite3_int64 size) {
+  // Drop blocks past the new end and clear the
+  // truncated part of the last block
+  CacheBlock* next;
+  for (CacheBlock* block = cache->head; block; block = next) {
+    next = block->next;
+    sqlite3_int64 start = block->index * CACHE_BLOCK_SIZE;
+    if (start >= size)
+      cache_discard(cache, block);
+    else if (start + CACHE_BLOCK_SIZE > size)
+      memset(&block->data[size - start], 0, (int)(start + CACHE_BLOCK_SIZE - size));
+  }
+  cache->size = size;
+  io_truncate(cache->rid, size);
+  return SQLITE_OK;
+}
+
+int cache_flush(Cache* cache) {
+  if (!cache->dirty)
+    return SQLITE_OK;
+
+  CacheBlock** dirty = malloc(cache->dirty * sizeof(CacheBlock*));
+  if (!dirty)
+    return SQLITE_IOERR_NOMEM;
+  int count = 0;
+  for (CacheBlock* block = cache->head; block; block = block->next) {
+    if (block->dirty)
+      dirty[count ++] = block;
+  }
+  qsort(dirty, count, sizeof(CacheBlock*), block_cmp);
+
+  int status = SQLITE_OK;
+  char* run = NULL;
+  for (int i = 0; i < count && status == SQLITE_OK;) {
+    // Find run of adjacent blocks
+    int j = i + 1;
+    while (j < count && j - i < CACHE_WRITE_RUN && dirty[j]->index == dirty[j - 1]->index + 1)
+      j ++;
+
+    sqlite3_int64 offset = dirty[i]->index * CACHE_BLOCK_SIZE;
+    sqlite3_int64 end = (dirty[j - 1]->index + 1) * CACHE_BLOCK_SIZE;
+    if (end > cache->size)
+      end = cache->size;
+    if (end > offset) {
+      int amount = (int)(end - offset);
+      const char* src = dirty[i]->data;
+      if (j - i > 1) {
+        if (!run)
+          run = malloc(CACHE_WRITE_RUN * CACHE_BLOCK_SIZE);
+        if (!run) {
+          status = SQLITE_IOERR_NOMEM;
+          break;
+        }
+        for (int k = i; k < j; k ++)
+          memcpy(&run[(k - i) * CACHE_BLOCK_SIZE], dirty[k]->data, CACHE_BLOCK_SIZE);
+        src = run;
+      }
+      int write_bytes = io_write(cache->rid, src, offset, amount);
+      debug_printf("flushed blocks (rid %i, offset %lli, amount %i, written %i)\n",
+        cache->rid, (long long)offset, amount, write_bytes);
+      if (write_bytes != amount) {
+        status = SQLITE_IOERR_WRITE;
+        break;
+      }
+    }
+
+    for (int k = i; k < j; k ++)
+      dirty[k]->dirty = 0;
+    cache->dirty -= j - i;
+    i = j;
+  }
+
+  free(run);
+  free(dirty);
+  return status;
+}
+
+int cache_refresh(Cache* cache) {
+  int status = cache_flush(cache);
+  if (status != SQLITE_OK)
+    return status;
+
+  sqlite3_int64 size = io_size(cache->rid);
+  CacheBlock* first = cache_lookup(cache, 0);
+  int changed = size != cache->size || (!first && cache->head);
+  if (!changed && first) {
+    // SQLite increments the change counter in the
+    // database header on every commit
+    char header[HEADER_SIZE];
+    int amount = size < HEADER_SIZE ? (int)size : HEADER_SIZE;
+    int read_bytes = io_read(cache->rid, header, 0, amount);
+    changed = read_bytes != amount || memcmp(header, first->data, amount);
+  }
+
+  if (changed) {
+    debug_printf("file changed, dropping cache (rid %i)\n", cache->rid);
+    while (cache->head)
+      cache_discard(cache, cache->head);
+    cache->size = size;
+    cache->last_block = -2;
+  }
+  return SQLITE_OK;
+}
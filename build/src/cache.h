@@ -0,0 +1,64 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sqlite3.h>
+
+// Block cache which sits between the VFS and the
+// js_read/ js_write imports. Files are cached in
+// fixed size blocks, writes are held back until
+// the cache is flushed.
+
+#define CACHE_BLOCK_SIZE 4096
+// Maximum number of blocks cached per file (1 MiB)
+#define CACHE_BLOCKS 256
+// Number of blocks read at once on sequential reads
+#define CACHE_READ_AHEAD 16
+// Maximum number of blocks written at once on flush
+#define CACHE_WRITE_RUN 64
+#define CACHE_BUCKETS 512
+
+typedef struct CacheBlock CacheBlock;
+struct CacheBlock {
+  sqlite3_int64 index;
+  int dirty;
+  // Doubly linked LRU list, head is most recently used
+  CacheBlock* prev;
+  CacheBlock* next;
+  // Hash bucket chain
+  CacheBlock* chain;
+  char data[CACHE_BLOCK_SIZE];
+};
+
+typedef struct Cache Cache;
+struct Cache {
+  // Deno file resource id
+  int rid;
+  // Size of the file, including pending writes
+  sqlite3_int64 size;
+  // Last block loaded, used to detect sequential reads
+  sqlite3_int64 last_block;
+  int blocks;
+  int dirty;
+  // Writes go to the file immediately
+  int write_through;
+  CacheBlock* head;
+  CacheBlock* tail;
+  CacheBlock* buckets[CACHE_BUCKETS];
+};
+
+// If write_through is set, writes are passed to the file
+// immediately and only reads are cached.
+void cache_init(Cache* cache, int rid, int write_through);
+void cache_free(Cache* cache);
+
+// These return SQLite status codes
+int cache_read(Cache* cache, void* buf, int amount, sqlite3_int64 offset);
+int cache_write(Cache* cache, const void* buf, int amount, sqlite3_int64 offset);
+int cache_truncate(Cache* cache, sqlite3_int64 size);
+int cache_flush(Cache* cache);
+
+// Drop all cached blocks, if the file was changed
+// by someone else.
+int cache_refresh(Cache* cache);
+
+#endif // CACHE_H
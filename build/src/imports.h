@@ -7,11 +7,23 @@ extern void   js_print(const char*);
 extern int    js_open(const char*, int);
 extern void   js_close(int);
 extern void   js_delete(const char*);
-extern int    js_read(int, const char*, int, int);
-extern int    js_write(int, const char*, int, int);
-extern void   js_truncate(int, int);
-extern int    js_size(int);
+// File offsets and sizes are passed as doubles, to
+// support files larger than 2 GiB.
+extern int    js_read(int, const char*, double, int);
+extern int    js_write(int, const char*, double, int);
+extern void   js_truncate(int, double);
+extern double js_size(int);
+extern int    js_lock(int, int);
+extern void   js_unlock(int, int);
+extern int    js_check_reserved(int);
+// Claim the WAL index of a database file, see denoShmMap
+extern int    js_shm_claim(int);
+extern void   js_shm_release(int);
+extern void   js_sleep(double);
 extern double js_time();
+// High resolution time in ms, used for profiling
+extern double js_now();
+extern void   js_trace(const char*, double);
 extern int    js_exists(const char*);
 extern int    js_access(const char*);
 
@@ -0,0 +1,69 @@
+#include <string.h>
+#include "imports.h"
+#include "stats.h"
+
+VfsStats vfs_stats;
+int stats_timing = 0;
+
+void stats_reset() {
+  memset(&vfs_stats, 0, sizeof(VfsStats));
+}
+
+// Timing calls into JS twice per operation, so
+// this is only done while profiling.
+static double timer_start() {
+  return stats_timing ? js_now() : 0;
+}
+static void timer_stop(double start) {
+  if (stats_timing)
+    vfs_stats.io_time += js_now() - start;
+}
+
+int io_open(const char* path, int mode) {
+  double start = timer_start();
+  int rid = js_open(path, mode);
+  vfs_stats.opens ++;
+  timer_stop(start);
+  return rid;
+}
+
+void io_close(int rid) {
+  double start = timer_start();
+  js_close(rid);
+  timer_stop(start);
+}
+
+int io_read(int rid, char* buf, sqlite3_int64 offset, int amount) {
+  double start = timer_start();
+  int read_bytes = js_read(rid, buf, (double)offset, amount);
+  vfs_stats.reads ++;
+  if (read_bytes > 0)
+    vfs_stats.read_bytes += read_bytes;
+  timer_stop(start);
+  return read_bytes;
+}
+
+int io_write(int rid, const char* buf, sqlite3_int64 offset, int amount) {
+  double start = timer_start();
+  int write_bytes = js_write(rid, buf, (double)offset, amount);
+  vfs_stats.writes ++;
+  if (write_bytes > 0)
+    vfs_stats.write_bytes += write_bytes;
+  timer_stop(start);
+  return write_bytes;
+}
+
+void io_truncate(int rid, sqlite3_int64 size) {
+  double start = timer_start();
+  js_truncate(rid, (double)size);
+  vfs_stats.truncates ++;
+  timer_stop(start);
+}
+
+sqlite3_int64 io_size(int rid) {
+  double start = timer_start();
+  sqlite3_int64 size = (sqlite3_int64)js_size(rid);
+  vfs_stats.size_calls ++;
+  timer_stop(start);
+  return size;
+}
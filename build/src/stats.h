@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <sqlite3.h>
+
+// Counters for file I/O done by the VFS. All file
+// access goes through the io_* functions below, which
+// count calls and bytes, and time the js_* imports
+// while stats_timing is set.
+//
+// Fields are doubles, so JS can read the struct as a
+// Float64Array. The field order is mirrored in
+// src/db.ts (DB.ioStats).
+
+typedef struct VfsStats VfsStats;
+struct VfsStats {
+  double reads;
+  double read_bytes;
+  double writes;
+  double write_bytes;
+  double syncs;
+  double size_calls;
+  double truncates;
+  double opens;
+  double locks;
+  double cache_hits;
+  double cache_misses;
+  // Milliseconds spent in js_* file imports,
+  // only measured while stats_timing is set
+  double io_time;
+};
+
+extern VfsStats vfs_stats;
+extern int stats_timing;
+
+void stats_reset();
+
+// Counting wrappers of the js_* file imports
+int    io_open(const char* path, int mode);
+void   io_close(int rid);
+int    io_read(int rid, char* buf, sqlite3_int64 offset, int amount);
+int    io_write(int rid, const char* buf, sqlite3_int64 offset, int amount);
+void   io_truncate(int rid, sqlite3_int64 size);
+sqlite3_int64 io_size(int rid);
+
+#endif // STATS_H
@@ -5,6 +5,8 @@
 #include <pcg.h>
 #include "debug.h"
 #include "imports.h"
+#include "cache.h"
+#include "stats.h"
 
 // SQLite VFS component.
 // Based on demoVFS from SQLlite.
@@ -20,11 +22,19 @@ struct DenoFile {
   sqlite3_file base;
   // Deno file resource id
   int rid;
+  // Current SQLite lock level
+  int lock;
+  // Block cache for reads and writes
+  Cache cache;
+  // WAL index regions, see denoShmMap
+  int shm_count;
+  void** shm;
 };
 
 static int denoClose(sqlite3_file *pFile) {
   DenoFile* p = (DenoFile*)pFile;
-  js_close(p->rid);
+  cache_free(&p->cache);
+  io_close(p->rid);
   debug_printf("closing file (rid %i)\n", p->rid);
   return SQLITE_OK;
 }
@@ -32,67 +42,87 @@ static int denoClose(sqlite3_file *pFile) {
 // Read data from a file.
 static int denoRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite_int64 iOfst) {
   DenoFile *p = (DenoFile*)pFile;
-
-  // Read bytes from buffer
-  int read_bytes = js_read(p->rid, (char*)zBuf, (int)iOfst, iAmt);
-  debug_printf("attempt to read from file (rid %i, amount %i, offset %i, read %i)\n",
-    p->rid, iAmt, (int)iOfst, read_bytes);
-
-  // Zero memory if read was short
-  if (read_bytes < iAmt)
-    memset(&((char*)zBuf)[iOfst+read_bytes], 0, iAmt-read_bytes);
-
-  return read_bytes < iAmt ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+  int status = cache_read(&p->cache, zBuf, iAmt, iOfst);
+  debug_printf("attempt to read from file (rid %i, amount %i, offset %lli, status %i)\n",
+    p->rid, iAmt, (long long)iOfst, status);
+  return status;
 }
 
-// Write data to a file.
+// Write data to a file. The data is only written to the
+// cache and written back to the file on sync.
 static int denoWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite_int64 iOfst) {
   DenoFile *p = (DenoFile*)pFile;
-
-  // Write bytes to buffer
-  int write_bytes = js_write(p->rid, (char*)zBuf, (int)iOfst, iAmt);
-  debug_printf("attempt to write to file (rid %i, amount %i, offset %i, written %i)\n",
-    p->rid, iAmt, (int)iOfst, write_bytes);
-
-  return write_bytes == iAmt ? SQLITE_OK : SQLITE_IOERR_WRITE;
+  int status = cache_write(&p->cache, zBuf, iAmt, iOfst);
+  debug_printf("attempt to write to file (rid %i, amount %i, offset %lli, status %i)\n",
+    p->rid, iAmt, (long long)iOfst, status);
+  return status;
 }
 
 // Truncate file.
 static int denoTruncate(sqlite3_file *pFile, sqlite_int64 size) {
   DenoFile *p = (DenoFile*)pFile;
-  js_truncate(p->rid, size);
-  debug_printf("truncating file (rid %i, size: %li)\n", p->rid, size);
-  return SQLITE_OK;
+  debug_printf("truncating file (rid %i, size: %lli)\n", p->rid, (long long)size);
+  return cache_truncate(&p->cache, size);
 }
 
 // Deno provides no explicit sync for us, so we
-// just have a no-op here.
+// only write back pending changes.
 // TODO(dyedgreen): Investigate if there is a better way
 static int denoSync(sqlite3_file *pFile, int flags) {
-  debug_printf("no-op call to sync");
-  return SQLITE_OK;
+  DenoFile *p = (DenoFile*)pFile;
+  debug_printf("flushing cache on sync (rid %i)\n", p->rid);
+  vfs_stats.syncs ++;
+  return cache_flush(&p->cache);
 }
 
-// Write the size of the file in bytes to *pSize.
+// Write the size of the file in bytes to *pSize. The size
+// is tracked by the cache, to avoid calling into JS.
 static int denoFileSize(sqlite3_file *pFile, sqlite_int64 *pSize) {
   DenoFile *p = (DenoFile*)pFile;
-  *pSize = (sqlite_int64)js_size(p->rid);
-  debug_printf("read file size: %i (rid %i)\n", (int)*pSize, p->rid);
+  *pSize = p->cache.size;
+  debug_printf("read file size: %lli (rid %i)\n", (long long)*pSize, p->rid);
   return SQLITE_OK;
 }
 
-// Deno does not support file locks.
+// Deno does not support file locks, so locks are tracked in
+// a table shared by all connections in this process (see
+// vfs.js). This is only safe as long as no other process
+// accesses the database file at the same time.
 static int denoLock(sqlite3_file *pFile, int eLock) {
-  debug_printf("no-op call to lock");
-  return SQLITE_OK;
+  DenoFile *p = (DenoFile*)pFile;
+  int prev = p->lock;
+  vfs_stats.locks ++;
+  p->lock = js_lock(p->rid, eLock);
+  int status = p->lock >= eLock ? SQLITE_OK : SQLITE_BUSY;
+
+  // The file may have been changed while we held no lock
+  if (prev == SQLITE_LOCK_NONE && p->lock >= SQLITE_LOCK_SHARED) {
+    int refresh_status = cache_refresh(&p->cache);
+    if (refresh_status != SQLITE_OK) {
+      js_unlock(p->rid, SQLITE_LOCK_NONE);
+      p->lock = SQLITE_LOCK_NONE;
+      status = refresh_status;
+    }
+  }
+
+  debug_printf("lock file (rid %i, lock %i, held %i, status %i)\n", p->rid, eLock, p->lock, status);
+  return status;
 }
 static int denoUnlock(sqlite3_file *pFile, int eLock) {
-  debug_printf("no-op call to unlock");
-  return SQLITE_OK;
+  DenoFile *p = (DenoFile*)pFile;
+  int status = SQLITE_OK;
+  // Write back any changes before others can read them
+  if (eLock <= SQLITE_LOCK_SHARED)
+    status = cache_flush(&p->cache);
+  js_unlock(p->rid, eLock);
+  p->lock = eLock;
+  debug_printf("unlock file (rid %i, lock %i, status %i)\n", p->rid, eLock, status);
+  return status;
 }
 static int denoCheckReservedLock(sqlite3_file *pFile, int *pResOut) {
-  debug_printf("no-op call to check reserved lock");
-  *pResOut = 0;
+  DenoFile *p = (DenoFile*)pFile;
+  *pResOut = js_check_reserved(p->rid);
+  debug_printf("check reserved lock (rid %i, reserved %i)\n", p->rid, *pResOut);
   return SQLITE_OK;
 }
 
@@ -109,6 +139,60 @@ static int denoDeviceCharacteristics(sqlite3_file *pFile) {
   return 0;
 }
 
+// Map a region of the WAL index. Every database runs in its
+// own WASM instance and Deno can not memory map files, so
+// this follows the "WAL without shared memory" approach and
+// keeps the regions on the heap. Since the index can not be
+// shared, the first connection to map it claims the database
+// file (see vfs.js), and other connections are refused with
+// SQLITE_BUSY until it is unmapped again.
+static int denoShmMap(sqlite3_file *pFile, int iRegion, int szRegion, int bExtend, void volatile **pp) {
+  DenoFile *p = (DenoFile*)pFile;
+  if (!p->shm_count && !js_shm_claim(p->rid)) {
+    debug_printf("WAL index is claimed by another connection (rid %i)\n", p->rid);
+    return SQLITE_BUSY;
+  }
+  if (iRegion >= p->shm_count) {
+    if (!bExtend) {
+      *pp = NULL;
+      return SQLITE_OK;
+    }
+    void** shm = realloc(p->shm, (iRegion + 1) * sizeof(void*));
+    if (!shm)
+      return SQLITE_IOERR_NOMEM;
+    p->shm = shm;
+    for (; p->shm_count <= iRegion; p->shm_count ++) {
+      p->shm[p->shm_count] = calloc(1, szRegion);
+      if (!p->shm[p->shm_count])
+        return SQLITE_IOERR_NOMEM;
+    }
+    debug_printf("mapped WAL index regions (rid %i, count %i)\n", p->rid, p->shm_count);
+  }
+  *pp = p->shm[iRegion];
+  return SQLITE_OK;
+}
+
+// The WAL index is only used by the connection which
+// claimed it, so there is nothing to lock or synchronize.
+static int denoShmLock(sqlite3_file *pFile, int offset, int n, int flags) {
+  return SQLITE_OK;
+}
+static void denoShmBarrier(sqlite3_file *pFile) {
+  return;
+}
+
+static int denoShmUnmap(sqlite3_file *pFile, int deleteFlag) {
+  DenoFile *p = (DenoFile*)pFile;
+  for (int i = 0; i < p->shm_count; i ++)
+    free(p->shm[i]);
+  free(p->shm);
+  p->shm = NULL;
+  p->shm_count = 0;
+  js_shm_release(p->rid);
+  debug_printf("unmapped WAL index (rid %i)\n", p->rid);
+  return SQLITE_OK;
+}
+
 // Open a file handle.
 static int denoOpen(
   sqlite3_vfs *pVfs,              /* VFS */
@@ -118,7 +202,7 @@ static int denoOpen(
   int *pOutFlags                  /* Output SQLITE_OPEN_XXX flags (or NULL) */
 ) {
   static const sqlite3_io_methods denoio = {
-    1,                            /* iVersion */
+    2,                            /* iVersion */
     denoClose,                    /* xClose */
     denoRead,                     /* xRead */
     denoWrite,                    /* xWrite */
@@ -130,7 +214,11 @@ static int denoOpen(
     denoCheckReservedLock,        /* xCheckReservedLock */
     denoFileControl,              /* xFileControl */
     denoSectorSize,               /* xSectorSize */
-    denoDeviceCharacteristics     /* xDeviceCharacteristics */
+    denoDeviceCharacteristics,    /* xDeviceCharacteristics */
+    denoShmMap,                   /* xShmMap */
+    denoShmLock,                  /* xShmLock */
+    denoShmBarrier,               /* xShmBarrier */
+    denoShmUnmap                  /* xShmUnmap */
   };
 
   DenoFile *p = (DenoFile*)pFile;
@@ -140,7 +228,14 @@ static int denoOpen(
   // the permission error on the vfs.js side of things,
   // should the error be propagates through the wrapper
   // and be raised on the wrapper side of things?
-  p->rid = js_open(zName, zName ? 0 : 1);
+  if (!zName)
+    p->rid = io_open(zName, 1);
+  else
+    p->rid = io_open(zName, flags & SQLITE_OPEN_READONLY ? 2 : 0);
+  p->lock = SQLITE_LOCK_NONE;
+  p->shm_count = 0;
+  p->shm = NULL;
+  cache_init(&p->cache, p->rid, flags & SQLITE_OPEN_WAL ? 1 : 0);
 
   if (pOutFlags) {
     *pOutFlags = flags;
@@ -199,9 +294,10 @@ static int denoRandomness(sqlite3_vfs *pVfs, int nByte, char *zByte) {
   return SQLITE_OK;
 }
 
-// TODO(dyedgreen): Can anything be done here?
+// Used by SQLite to wait for locks held by other connections.
 static int denoSleep(sqlite3_vfs *pVfs, int nMicro) {
-  return 0;
+  js_sleep(nMicro / 1000.0);
+  return nMicro;
 }
 
 // Retrieve the current time
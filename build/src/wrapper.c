@@ -1,7 +1,11 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <sqlite3.h>
 #include <pcg.h>
 #include "debug.h"
+#include "imports.h"
+#include "stats.h"
 
 #define EXPORT(name) __attribute__((used)) __attribute__((export_name (#name))) name
 #define ERROR_VAL -1
@@ -10,10 +14,61 @@
 #define JS_MAX_SAFE_INTEGER 9007199254740991
 #define JS_MIN_SAFE_INTEGER (-JS_MAX_SAFE_INTEGER)
 
+// Row batches start out at this size and grow as needed.
+// Once a batch exceeds the soft limit, no further rows are
+// added to it.
+#define BATCH_MIN_SIZE 4096
+#define BATCH_SOFT_LIMIT 65536
+// Batch buffers larger than this only grow to hold single
+// large rows and are freed once the statement is done.
+#define BATCH_TRIM_SIZE (2 * BATCH_SOFT_LIMIT)
+#define BATCH_ALIGN(n) (((n) + 7) & ~7)
+
+// Milliseconds to wait for locks held by other connections,
+// before giving up with SQLITE_BUSY. See DB.busyTimeout.
+#define DEFAULT_BUSY_TIMEOUT 5000
+
+// When built with a fixed heap size, SQLite allocates all memory from a
+// single region using memsys5 instead of going through malloc/ free.
+#ifdef DENO_SQLITE_HEAP
+#define HEAP_MIN_ALLOC 64
+static int heap_configured = 0;
+#endif
+
 // Status returned by last instruction
 int last_status = SQLITE_OK;
 // Database handle for this instance
 sqlite3* database = NULL;
+// Buffer holding the last batch of rows
+char* batch_buf = NULL;
+int batch_size = 0;
+
+// Make sure the batch buffer can hold at least size bytes.
+static int batch_reserve(int size) {
+  if (size <= batch_size)
+    return 1;
+  int new_size = batch_size ? batch_size : BATCH_MIN_SIZE;
+  while (new_size < size)
+    new_size *= 2;
+  char* new_buf = realloc(batch_buf, new_size);
+  if (!new_buf)
+    return 0;
+  batch_buf = new_buf;
+  batch_size = new_size;
+  debug_printf("grew row batch buffer to %i bytes\n", batch_size);
+  return 1;
+}
+
+// Free the batch buffer, if it grew past the size needed by
+// regular batches.
+static void batch_trim() {
+  if (batch_size > BATCH_TRIM_SIZE) {
+    free(batch_buf);
+    batch_buf = NULL;
+    batch_size = 0;
+    debug_printf("freed large row batch buffer\n");
+  }
+}
 
 // Return length of string pointed to by str.
 int EXPORT(str_len) (const char* str) {
@@ -34,19 +89,40 @@ int EXPORT(get_status) () {
 }
 
 // Initialize the database and return the status.
-int EXPORT(open) (const char* filename) {
+int EXPORT(open) (const char* filename, int readonly) {
   // Return error is database is already open
   if (database) {
     last_status = SQLITE_MISUSE;
     return last_status;
   }
 
+#ifdef DENO_SQLITE_HEAP
+  // The heap must be configured before SQLite is initialized
+  // by the first call to open.
+  if (!heap_configured) {
+    void* heap = malloc(DENO_SQLITE_HEAP);
+    if (!heap) {
+      last_status = SQLITE_NOMEM;
+      return last_status;
+    }
+    last_status = sqlite3_config(SQLITE_CONFIG_HEAP, heap, DENO_SQLITE_HEAP, HEAP_MIN_ALLOC);
+    if (last_status != SQLITE_OK) {
+      debug_printf("failed to configure heap with status %i\n", last_status);
+      free(heap);
+      return last_status;
+    }
+    heap_configured = 1;
+  }
+#endif
+
   // Open SQLite db connection
-  last_status = sqlite3_open(filename, &database);
+  int flags = readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  last_status = sqlite3_open_v2(filename, &database, flags, NULL);
   if (last_status != SQLITE_OK) {
     debug_printf("failed to open database with status %i\n", last_status);
     return last_status;
   }
+  sqlite3_busy_timeout(database, DEFAULT_BUSY_TIMEOUT);
   debug_printf("opened database at path '%s'\n", filename);
   return last_status;
 }
@@ -71,10 +147,12 @@ const char* EXPORT(get_sqlite_error_str) () {
 }
 
 // Wraps sqlite3_prepare. Returns statement id.
-sqlite3_stmt* EXPORT(prepare) (const char* sql) {
-  // Prepare sqlite statement
+sqlite3_stmt* EXPORT(prepare) (const char* sql, int len) {
+  // Prepare sqlite statement. The length passed from JS does not
+  // include the \0 terminator, passing it along lets SQLite skip
+  // copying the SQL text.
   sqlite3_stmt* stmt;
-  last_status = sqlite3_prepare_v2(database, sql, -1, &stmt, NULL);
+  last_status = sqlite3_prepare_v2(database, sql, len + 1, &stmt, NULL);
   debug_printf("prepared sql statement (status %i)\n", last_status);
 
   if (last_status != SQLITE_OK)
@@ -87,10 +165,27 @@ sqlite3_stmt* EXPORT(prepare) (const char* sql) {
 // status, the statement id will be freed up.
 int EXPORT(finalize) (sqlite3_stmt* stmt) {
   last_status = sqlite3_finalize(stmt);
+  batch_trim();
   debug_printf("finalized statement (status %i)\n", last_status);
   return last_status;
 }
 
+// Reset the given statement, so it can be stepped again. This does
+// not clear bound values, use `clear_bindings` for that.
+int EXPORT(reset) (sqlite3_stmt* stmt) {
+  last_status = sqlite3_reset(stmt);
+  batch_trim();
+  debug_printf("reset statement (status %i)\n", last_status);
+  return last_status;
+}
+
+// Set all bound values of the given statement to NULL.
+int EXPORT(clear_bindings) (sqlite3_stmt* stmt) {
+  last_status = sqlite3_clear_bindings(stmt);
+  debug_printf("cleared statement bindings (status %i)\n", last_status);
+  return last_status;
+}
+
 // Wrappers for bind statements, these return the status directly
 int EXPORT(bind_int) (sqlite3_stmt* stmt, int idx, double value) {
   // we use double to pass in the value, as JS does not support 64 bit integers,
@@ -107,35 +202,29 @@ int EXPORT(bind_double) (sqlite3_stmt* stmt, int idx, double value) {
   return last_status;
 }
 
-int EXPORT(bind_text) (sqlite3_stmt* stmt, int idx, const char* value) {
+int EXPORT(bind_text) (sqlite3_stmt* stmt, int idx, const char* value, int len) {
   // SQLite retrains the string until we execute the statement, but any strings
   // passed in from JS are freed when the function returns. Thus we need to mark
   // is as transient.
-  last_status = sqlite3_bind_text(stmt, idx, value, -1, SQLITE_TRANSIENT);
+  last_status = sqlite3_bind_text(stmt, idx, value, len, SQLITE_TRANSIENT);
   debug_printf("binding text '%s' (status %i)\n", value, last_status);
   return last_status;
 }
 
-int EXPORT(bind_blob) (sqlite3_stmt* stmt, int idx, void* value, int size) {
-  // SQLite retrains the pointer until we execute the statement, but any pointers
-  // passed in from JS are freed when the function returns. Thus we need to mark
-  // is as transient.
-  last_status = sqlite3_bind_blob(stmt, idx, value, size, SQLITE_TRANSIENT);
+int EXPORT(bind_blob) (sqlite3_stmt* stmt, int idx, void* value, int size, int is_static) {
+  // SQLite retrains the pointer until we execute the statement. Pointers passed in
+  // from JS are usually freed when the function returns, in which case we need to
+  // mark them as transient. If the caller keeps the buffer alive until the statement
+  // is reset, we can skip the copy.
+  last_status = sqlite3_bind_blob(stmt, idx, value, size, is_static ? SQLITE_STATIC : SQLITE_TRANSIENT);
   debug_printf("binding blob '%s' (status %i)\n", value, last_status);
   return last_status;
 }
 
-int EXPORT(bind_big_int) (sqlite3_stmt* stmt, int idx, const char* value) {
-  // Bind a big integer, passed as a string
-  sqlite3_int64 int_val = 0;
-  sqlite3_int64 pow = 1;
-  for (int i = 0; value[i] != '\0'; i ++)
-    pow *= 10;
-  for (int i = 0; value[i] != '\0'; i ++) {
-    pow /= 10;
-    int_val += pow * (value[i] - '0');
-  }
-  debug_printf("binding big_int '%s' -> %lld", value, int_val);
+int EXPORT(bind_big_int) (sqlite3_stmt* stmt, int idx, int high, unsigned int low) {
+  // Bind a big integer, passed as two 32 bit halves
+  sqlite3_int64 int_val = (sqlite3_int64)(((uint64_t)(uint32_t)high << 32) | low);
+  debug_printf("binding big_int %lld", int_val);
   last_status = sqlite3_bind_int64(stmt, idx, int_val);
   return last_status;
 }
@@ -184,6 +273,158 @@ int EXPORT(column_type) (sqlite3_stmt* stmt, int col) {
   return type;
 }
 
+// Read up to max_rows rows into the batch buffer, starting from the
+// current row and stepping the statement after each row. The status
+// of the last step is stored in last_status. Returns a pointer to the
+// batch or NULL if we ran out of memory.
+//
+// The batch starts with the row and column count (two int32), followed
+// by one cell for every column of every row. Each cell has an int32 type
+// and an int32 byte length, followed by a payload which is padded to 8
+// bytes:
+//   - SQLITE_INTEGER: the value as a double
+//   - BIG_INT_TYPE: the value as an int64
+//   - SQLITE_FLOAT: the value as a double
+//   - SQLITE_TEXT, SQLITE_BLOB: the raw bytes
+//   - SQLITE_NULL: no payload
+const char* EXPORT(step_rows) (sqlite3_stmt* stmt, int max_rows) {
+  int cols = sqlite3_column_count(stmt);
+  int rows = 0;
+  int used = 8;
+  if (!batch_reserve(used)) {
+    last_status = SQLITE_NOMEM;
+    return NULL;
+  }
+
+  last_status = SQLITE_ROW;
+  while (last_status == SQLITE_ROW && rows < max_rows && used < BATCH_SOFT_LIMIT) {
+    for (int col = 0; col < cols; col ++) {
+      int type = sqlite3_column_type(stmt, col);
+      sqlite3_int64 int_val = 0;
+      const void* data = NULL;
+      int len = 0;
+      int payload = 0;
+      switch (type) {
+        case SQLITE_INTEGER:
+          int_val = sqlite3_column_int64(stmt, col);
+          if (int_val > JS_MAX_SAFE_INTEGER || int_val < JS_MIN_SAFE_INTEGER)
+            type = BIG_INT_TYPE;
+          payload = 8;
+          break;
+        case SQLITE_FLOAT:
+          payload = 8;
+          break;
+        case SQLITE_TEXT:
+          data = sqlite3_column_text(stmt, col);
+          len = sqlite3_column_bytes(stmt, col);
+          payload = BATCH_ALIGN(len);
+          break;
+        case SQLITE_BLOB:
+          data = sqlite3_column_blob(stmt, col);
+          len = sqlite3_column_bytes(stmt, col);
+          // Zero pointer results in null
+          if (!data)
+            type = SQLITE_NULL;
+          payload = BATCH_ALIGN(len);
+          break;
+      }
+
+      if (!batch_reserve(used + 8 + payload)) {
+        last_status = SQLITE_NOMEM;
+        return NULL;
+      }
+      int32_t* head = (int32_t*)&batch_buf[used];
+      head[0] = type;
+      head[1] = len;
+      used += 8;
+      switch (type) {
+        case SQLITE_INTEGER:
+          *(double*)&batch_buf[used] = (double)int_val;
+          break;
+        case BIG_INT_TYPE:
+          *(int64_t*)&batch_buf[used] = int_val;
+          break;
+        case SQLITE_FLOAT:
+          *(double*)&batch_buf[used] = sqlite3_column_double(stmt, col);
+          break;
+        case SQLITE_TEXT:
+        case SQLITE_BLOB:
+          if (data)
+            memcpy(&batch_buf[used], data, len);
+          break;
+      }
+      used += payload;
+    }
+    rows ++;
+    last_status = sqlite3_step(stmt);
+  }
+
+  ((int32_t*)batch_buf)[0] = rows;
+  ((int32_t*)batch_buf)[1] = cols;
+  debug_printf("read batch of %i rows, %i bytes (status %i)\n", rows, used, last_status);
+  return batch_buf;
+}
+
+// Bind and run the statement once for every row in the given batch, which
+// uses the same layout as the batches returned from step_rows. Any rows
+// returned by the statement are ignored. Text and blobs are bound without
+// copying them. Returns the number of rows run or ERROR_VAL.
+int EXPORT(run_rows) (sqlite3_stmt* stmt, const char* batch) {
+  int rows = ((const int32_t*)batch)[0];
+  int cols = ((const int32_t*)batch)[1];
+  const char* cell = &batch[8];
+
+  for (int row = 0; row < rows; row ++) {
+    for (int col = 0; col < cols; col ++) {
+      int type = ((const int32_t*)cell)[0];
+      int len = ((const int32_t*)cell)[1];
+      cell += 8;
+      switch (type) {
+        case SQLITE_INTEGER:
+          last_status = sqlite3_bind_int64(stmt, col + 1, (sqlite3_int64)*(const double*)cell);
+          cell += 8;
+          break;
+        case BIG_INT_TYPE:
+          last_status = sqlite3_bind_int64(stmt, col + 1, *(const int64_t*)cell);
+          cell += 8;
+          break;
+        case SQLITE_FLOAT:
+          last_status = sqlite3_bind_double(stmt, col + 1, *(const double*)cell);
+          cell += 8;
+          break;
+        case SQLITE_TEXT:
+          last_status = sqlite3_bind_text(stmt, col + 1, cell, len, SQLITE_STATIC);
+          cell += BATCH_ALIGN(len);
+          break;
+        case SQLITE_BLOB:
+          last_status = sqlite3_bind_blob(stmt, col + 1, cell, len, SQLITE_STATIC);
+          cell += BATCH_ALIGN(len);
+          break;
+        default:
+          last_status = sqlite3_bind_null(stmt, col + 1);
+          break;
+      }
+      if (last_status != SQLITE_OK) {
+        debug_printf("failed to bind batch value (row %i, col %i, status %i)\n", row, col, last_status);
+        return ERROR_VAL;
+      }
+    }
+
+    last_status = sqlite3_step(stmt);
+    if (last_status != SQLITE_DONE && last_status != SQLITE_ROW) {
+      debug_printf("failed to run batch row (row %i, status %i)\n", row, last_status);
+      return ERROR_VAL;
+    }
+    sqlite3_reset(stmt);
+  }
+
+  // The batch is freed once we return
+  sqlite3_clear_bindings(stmt);
+  last_status = SQLITE_OK;
+  debug_printf("ran batch of %i rows\n", rows);
+  return rows;
+}
+
 // Wrap result returning functions.
 double EXPORT(column_int) (sqlite3_stmt* stmt, int col) {
   return (double)sqlite3_column_int64(stmt, col);
@@ -217,6 +458,198 @@ const char* EXPORT(column_table_name) (sqlite3_stmt* stmt, int col) {
   return sqlite3_column_table_name(stmt, col);
 }
 
+// Run a checkpoint, mode is one of the SQLITE_CHECKPOINT_* values.
+int EXPORT(wal_checkpoint) (int mode) {
+  last_status = sqlite3_wal_checkpoint_v2(database, NULL, mode, NULL, NULL);
+  debug_printf("ran WAL checkpoint (mode %i, status %i)\n", mode, last_status);
+  return last_status;
+}
+
+// Set number of WAL frames after which a checkpoint is run
+// automatically. Zero or a negative value turns this off.
+int EXPORT(wal_autocheckpoint) (int frames) {
+  last_status = sqlite3_wal_autocheckpoint(database, frames);
+  debug_printf("set WAL auto checkpoint (frames %i, status %i)\n", frames, last_status);
+  return last_status;
+}
+
+// Open a BLOB for incremental I/O. Returns NULL on failure.
+sqlite3_blob* EXPORT(blob_open) (const char* schema, const char* table, const char* column, double row, int write) {
+  sqlite3_blob* blob;
+  last_status = sqlite3_blob_open(database, schema, table, column, (sqlite3_int64)row, write, &blob);
+  debug_printf("opened blob (table '%s', column '%s', status %i)\n", table, column, last_status);
+  if (last_status != SQLITE_OK)
+    return NULL;
+  return blob;
+}
+
+int EXPORT(blob_reopen) (sqlite3_blob* blob, double row) {
+  last_status = sqlite3_blob_reopen(blob, (sqlite3_int64)row);
+  debug_printf("reopened blob (status %i)\n", last_status);
+  return last_status;
+}
+
+int EXPORT(blob_bytes) (sqlite3_blob* blob) {
+  return sqlite3_blob_bytes(blob);
+}
+
+int EXPORT(blob_read) (sqlite3_blob* blob, void* buf, int size, int offset) {
+  last_status = sqlite3_blob_read(blob, buf, size, offset);
+  debug_printf("read from blob (size %i, offset %i, status %i)\n", size, offset, last_status);
+  return last_status;
+}
+
+int EXPORT(blob_write) (sqlite3_blob* blob, const void* buf, int size, int offset) {
+  last_status = sqlite3_blob_write(blob, buf, size, offset);
+  debug_printf("wrote to blob (size %i, offset %i, status %i)\n", size, offset, last_status);
+  return last_status;
+}
+
+int EXPORT(blob_close) (sqlite3_blob* blob) {
+  last_status = sqlite3_blob_close(blob);
+  debug_printf("closed blob (status %i)\n", last_status);
+  return last_status;
+}
+
+// Allocate a buffer to hold a database image passed to deserialize.
+// The memory comes from SQLite, which takes ownership of it once
+// passed to deserialize.
+unsigned char* EXPORT(image_alloc) (double size) {
+  unsigned char* image = sqlite3_malloc64((sqlite3_uint64)size);
+  if (!image)
+    last_status = SQLITE_NOMEM;
+  return image;
+}
+
+void EXPORT(image_free) (unsigned char* image) {
+  sqlite3_free(image);
+}
+
+// Replace the given schema with an in-memory database, using the image
+// allocated by image_alloc. Unless the database is read-only, it may
+// grow beyond the initial image. The image is freed if this fails.
+int EXPORT(deserialize) (const char* schema, unsigned char* image, double size, int readonly) {
+  unsigned int flags = SQLITE_DESERIALIZE_FREEONCLOSE;
+  flags |= readonly ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE;
+  last_status = sqlite3_deserialize(database, schema, image,
+    (sqlite3_int64)size, (sqlite3_int64)size, flags);
+#if SQLITE_VERSION_NUMBER < 3032000
+  // The pinned release only takes ownership of the image on
+  // success, later ones also free it when failing
+  if (last_status != SQLITE_OK)
+    sqlite3_free(image);
+#endif
+  debug_printf("deserialized database (schema '%s', size %lld, status %i)\n", schema, (sqlite3_int64)size, last_status);
+  return last_status;
+}
+
+// Size of the last image returned by serialize
+double serialized_size = 0;
+
+// Return an image of the given schema. If nocopy is set, this returns
+// the memory SQLite uses for a deserialized database, or NULL if there
+// is none. Otherwise the image is a copy which has to be released with
+// image_free. Returns NULL on failure, or if the database is empty
+// (in which case the status is SQLITE_OK and the size is zero).
+unsigned char* EXPORT(serialize) (const char* schema, int nocopy) {
+  sqlite3_int64 size = 0;
+  unsigned char* image = sqlite3_serialize(database, schema, &size, nocopy ? SQLITE_SERIALIZE_NOCOPY : 0);
+  serialized_size = (double)size;
+  last_status = image || nocopy || size == 0 ? SQLITE_OK : SQLITE_NOMEM;
+  debug_printf("serialized database (schema '%s', size %lld, copy %i)\n", schema, size, !nocopy);
+  return image;
+}
+
+double EXPORT(get_serialized_size) () {
+  return serialized_size;
+}
+
+// Set how long to wait for locks, a timeout of
+// zero or less disables waiting.
+int EXPORT(busy_timeout) (int ms) {
+  last_status = sqlite3_busy_timeout(database, ms);
+  return last_status;
+}
+
+// Returns zero if a transaction is open.
+int EXPORT(get_autocommit) () {
+  return sqlite3_get_autocommit(database);
+}
+
 double EXPORT(last_insert_rowid) () {
   return (double)sqlite3_last_insert_rowid(database);
 }
+
+// Return a global SQLite memory statistic, see sqlite3_status64. The
+// highwater mark is returned when highwater is set. Returns ERROR_VAL
+// on failure.
+double EXPORT(status64) (int op, int highwater, int reset) {
+  sqlite3_int64 current, high;
+  last_status = sqlite3_status64(op, &current, &high, reset);
+  if (last_status != SQLITE_OK)
+    return ERROR_VAL;
+  return (double)(highwater ? high : current);
+}
+
+// Return a statistic for the open database connection, see
+// sqlite3_db_status. Returns ERROR_VAL on failure.
+int EXPORT(db_status) (int op, int highwater, int reset) {
+  int current, high;
+  last_status = sqlite3_db_status(database, op, &current, &high, reset);
+  if (last_status != SQLITE_OK)
+    return ERROR_VAL;
+  return highwater ? high : current;
+}
+
+// Replace the lookaside memory of the connection, see
+// SQLITE_DBCONFIG_LOOKASIDE. Fails with SQLITE_BUSY while
+// lookaside memory is in use.
+int EXPORT(lookaside) (int slot_size, int slots) {
+  last_status = sqlite3_db_config(database, SQLITE_DBCONFIG_LOOKASIDE, NULL, slot_size, slots);
+  return last_status;
+}
+
+// Return a counter for the given statement, see sqlite3_stmt_status.
+int EXPORT(stmt_status) (sqlite3_stmt* stmt, int op, int reset) {
+  return sqlite3_stmt_status(stmt, op, reset);
+}
+
+// Return pointer to the VFS I/O counters, see stats.h.
+VfsStats* EXPORT(get_vfs_stats) () {
+  return &vfs_stats;
+}
+
+void EXPORT(reset_vfs_stats) () {
+  stats_reset();
+}
+
+// Turn timing of file I/O on or off, see DB.profile.
+void EXPORT(set_io_timing) (int enabled) {
+  stats_timing = enabled;
+}
+
+#ifndef SQLITE_OMIT_TRACE
+// Pass every statement which finished running to JS,
+// together with its run time in ms.
+static int trace_profile(unsigned int type, void* ctx, void* stmt, void* time) {
+  char* sql = sqlite3_expanded_sql((sqlite3_stmt*)stmt);
+  js_trace(sql ? sql : sqlite3_sql((sqlite3_stmt*)stmt), *(sqlite3_int64*)time / 1000000.0);
+  sqlite3_free(sql);
+  return 0;
+}
+#endif
+
+// Turn statement tracing on or off. Fails with SQLITE_MISUSE,
+// if SQLite was built without trace support.
+int EXPORT(trace) (int enabled) {
+#ifdef SQLITE_OMIT_TRACE
+  last_status = SQLITE_MISUSE;
+#else
+  if (enabled)
+    last_status = sqlite3_trace_v2(database, SQLITE_TRACE_PROFILE, trace_profile, NULL);
+  else
+    last_status = sqlite3_trace_v2(database, 0, NULL, NULL);
+#endif
+  debug_printf("set tracing (enabled %i, status %i)\n", enabled, last_status);
+  return last_status;
+}
@@ -1,5 +1,146 @@
 import { getStr } from "../src/wasm.ts";
 
+// File locks are tracked in a table shared by all
+// connections in this process. Each open file is
+// given a slot, which holds the number of shared
+// locks and a bit for each of the reserved, pending
+// and exclusive locks.
+//
+// The WAL index of a file can not be shared (see
+// denoShmMap in vfs.c), so the table also holds the
+// id of the file handle which claimed it. While a
+// WAL index is claimed, other handles can not lock
+// the file.
+//
+// Slots are found by probing from the hash of the
+// file path, and hold a 64 bit key of the path and
+// the number of handles using them. Slots are only
+// taken and freed while holding the table mutex.
+const LOCK_SLOTS = 1024;
+const WAL_CLAIMS = LOCK_SLOTS;
+const SLOT_KEYS = 2 * LOCK_SLOTS;
+const SLOT_REFS = 4 * LOCK_SLOTS;
+const NEXT_OWNER = 5 * LOCK_SLOTS;
+const TABLE_MUTEX = NEXT_OWNER + 1;
+const TABLE_SIZE = TABLE_MUTEX + 1;
+const SHARED = 1;
+const SHARED_MASK = 0xffff;
+const RESERVED = 1 << 16;
+const PENDING = 1 << 17;
+const EXCLUSIVE = 1 << 18;
+
+let locks = new Int32Array(new SharedArrayBuffer(4 * TABLE_SIZE));
+const sleeper = new Int32Array(new SharedArrayBuffer(4));
+
+// Return the shared lock table, to be passed to workers
+export function getLockTable() {
+  return locks.buffer;
+}
+
+// Use lock table from a different thread, this must be
+// called before any databases are opened
+export function setLockTable(buffer) {
+  locks = new Int32Array(buffer);
+}
+
+// Functions receiving traced statements, keyed
+// by the exports of the traced instance
+const traceHooks = new WeakMap();
+
+// Set function which receives statements traced by the
+// given instance, see DB.trace
+export function setTraceHook(exports, hook) {
+  if (hook) {
+    traceHooks.set(exports, hook);
+  } else {
+    traceHooks.delete(exports);
+  }
+}
+
+// Atomically update a lock slot, fn returns the
+// new value or null if the lock is not available
+function updateLock(slot, fn) {
+  for (;;) {
+    const current = Atomics.load(locks, slot);
+    const next = fn(current);
+    if (next === null) {
+      return false;
+    }
+    if (Atomics.compareExchange(locks, slot, current, next) === current) {
+      return true;
+    }
+  }
+}
+
+// Convert held lock bits to SQLite lock level
+function lockLevel(held) {
+  if (held & EXCLUSIVE) return 4;
+  if (held & PENDING) return 3;
+  if (held & RESERVED) return 2;
+  if (held & SHARED) return 1;
+  return 0;
+}
+
+// Hash path with 32 bit FNV-1a, starting from the given basis
+function hashPath(path, basis) {
+  let hash = basis;
+  for (let i = 0; i < path.length; i++) {
+    hash = Math.imul(hash ^ path.charCodeAt(i), 16777619);
+  }
+  return hash;
+}
+
+// Run fn while holding the table mutex
+function withTable(fn) {
+  while (Atomics.compareExchange(locks, TABLE_MUTEX, 0, 1) !== 0) {
+    Atomics.wait(locks, TABLE_MUTEX, 1);
+  }
+  try {
+    return fn();
+  } finally {
+    Atomics.store(locks, TABLE_MUTEX, 0);
+    Atomics.notify(locks, TABLE_MUTEX, 1);
+  }
+}
+
+// Take a reference to the slot of the given path, using
+// a free slot if no other handle has the file open
+function acquireSlot(path) {
+  const key0 = hashPath(path, 2166136261);
+  const key1 = hashPath(path, 3735928559);
+  const start = (key0 >>> 0) % LOCK_SLOTS;
+  return withTable(() => {
+    let free = -1;
+    for (let i = 0; i < LOCK_SLOTS; i++) {
+      const slot = (start + i) % LOCK_SLOTS;
+      if (Atomics.load(locks, SLOT_REFS + slot) === 0) {
+        if (free === -1) free = slot;
+      } else if (
+        Atomics.load(locks, SLOT_KEYS + 2 * slot) === key0 &&
+        Atomics.load(locks, SLOT_KEYS + 2 * slot + 1) === key1
+      ) {
+        Atomics.add(locks, SLOT_REFS + slot, 1);
+        return slot;
+      }
+    }
+    if (free === -1) {
+      throw new Error("Too many open database files.");
+    }
+    Atomics.store(locks, free, 0);
+    Atomics.store(locks, WAL_CLAIMS + free, 0);
+    Atomics.store(locks, SLOT_KEYS + 2 * free, key0);
+    Atomics.store(locks, SLOT_KEYS + 2 * free + 1, key1);
+    Atomics.store(locks, SLOT_REFS + free, 1);
+    return free;
+  });
+}
+
+// Drop a reference to a slot, the slot is free
+// once no handle uses it
+function releaseSlot(slot) {
+  withTable(() => Atomics.sub(locks, SLOT_REFS + slot, 1));
+}
+
 // Closure to return an environment that links
 // the current wasm context
 export default function env(inst) {
@@ -7,6 +148,40 @@ export default function env(inst) {
   // some of Deno's os methods use files-names
   // instead of resource ids.
   const files = new Map();
+  // Track the current offset of each file, to
+  // avoid seeking when reads or writes are
+  // sequential.
+  const offsets = new Map();
+  // Lock slot, held lock bits and unique owner
+  // id (used to claim WAL indices) for each file
+  const slots = new Map();
+  const held = new Map();
+  const owners = new Map();
+
+  // Release lock bits held for the given file
+  const release = (rid, bits) => {
+    if (bits) {
+      updateLock(slots.get(rid), (state) => state - bits);
+      held.set(rid, held.get(rid) - bits);
+    }
+  };
+
+  // Release the WAL index claim held for the given file
+  const releaseClaim = (rid) => {
+    Atomics.compareExchange(
+      locks,
+      WAL_CLAIMS + slots.get(rid),
+      owners.get(rid),
+      0,
+    );
+  };
+
+  // Seek file to offset, if it is not there already
+  const seek = (rid, offset) => {
+    if (offsets.get(rid) !== offset) {
+      Deno.seekSync(rid, offset, Deno.SeekMode.Start);
+    }
+  };
 
   // Exported environment
   const env = {
@@ -15,41 +190,64 @@ export default function env(inst) {
       const text = getStr(inst.exports, str_ptr);
       console.log(text[text.length - 1] === "\n" ? text.slice(0, -1) : text);
     },
-    // Open the file at path, mode = 0 is open RW, mode = 1 is open TEMP
+    // Open the file at path, mode = 0 is open RW, mode = 1 is open TEMP,
+    // mode = 2 is open READ
     js_open: (path_ptr, mode) => {
       let path;
       switch (mode) {
         case 0:
+        case 2:
           path = getStr(inst.exports, path_ptr);
           break;
         case 1:
           path = Deno.makeTempFileSync({ prefix: "deno_sqlite" });
           break;
       }
-      let rid =
-        Deno.openSync(path, { read: true, write: true, create: true }).rid;
+      const write = mode !== 2;
+      let rid = Deno.openSync(path, { read: true, write, create: write }).rid;
+      let slot;
+      try {
+        slot = acquireSlot(Deno.realPathSync(path));
+      } catch (error) {
+        Deno.close(rid);
+        throw error;
+      }
       files.set(rid, path);
+      offsets.set(rid, 0);
+      slots.set(rid, slot);
+      held.set(rid, 0);
+      owners.set(rid, Atomics.add(locks, NEXT_OWNER, 1) + 1);
       return rid;
     },
     // Close a file
     js_close: (rid) => {
+      release(rid, held.get(rid));
+      releaseClaim(rid);
+      releaseSlot(slots.get(rid));
       Deno.close(rid);
       files.delete(rid);
+      offsets.delete(rid);
+      slots.delete(rid);
+      held.delete(rid);
+      owners.delete(rid);
     },
     // Delete file at path
     js_delete: (path_ptr) => {
       let path = getStr(inst.exports, path_ptr);
       Deno.removeSync(path);
     },
-    // Read from a file to a buffer in the module
+    // Read from a file to a buffer in the module, offsets
+    // are passed as doubles to support large files
     js_read: (rid, buffer_ptr, offset, amount) => {
       const buffer = new Uint8Array(
         inst.exports.memory.buffer,
         buffer_ptr,
         amount,
       );
-      Deno.seekSync(rid, offset, Deno.SeekMode.Start);
-      return Deno.readSync(rid, buffer);
+      seek(rid, offset);
+      const read = Deno.readSync(rid, buffer) ?? 0;
+      offsets.set(rid, offset + read);
+      return read;
     },
     // Write to a file from a buffer in the module
     js_write: (rid, buffer_ptr, offset, amount) => {
@@ -58,8 +256,10 @@ export default function env(inst) {
         buffer_ptr,
         amount,
       );
-      Deno.seekSync(rid, offset, Deno.SeekMode.Start);
-      return Deno.writeSync(rid, buffer);
+      seek(rid, offset);
+      const written = Deno.writeSync(rid, buffer);
+      offsets.set(rid, offset + written);
+      return written;
     },
     // Truncate the given file
     js_truncate: (rid, size) => {
@@ -69,10 +269,96 @@ export default function env(inst) {
     js_size: (rid) => {
       return Deno.statSync(files.get(rid)).size;
     },
+    // Acquire a lock on the given file, returns the
+    // lock level which is held afterwards
+    js_lock: (rid, level) => {
+      const slot = slots.get(rid);
+      let bits = held.get(rid);
+      const claim = Atomics.load(locks, WAL_CLAIMS + slot);
+      if (claim !== 0 && claim !== owners.get(rid)) {
+        // Another connection uses the file in WAL mode
+        return lockLevel(bits);
+      }
+      const acquire = (blocked, bit) =>
+        updateLock(slot, (state) => state & blocked ? null : state + bit);
+      if (!(bits & SHARED) && acquire(PENDING | EXCLUSIVE, SHARED)) {
+        bits |= SHARED;
+      }
+      if (level === 2 && bits & SHARED && !(bits & RESERVED)) {
+        if (acquire(RESERVED | PENDING | EXCLUSIVE, RESERVED)) {
+          bits |= RESERVED;
+        }
+      }
+      if (level === 4 && bits & SHARED) {
+        // Pending lock stops new readers, while we wait for
+        // existing readers to finish
+        const blocked = PENDING | EXCLUSIVE | (bits & RESERVED ? 0 : RESERVED);
+        if (!(bits & PENDING) && acquire(blocked, PENDING)) {
+          bits |= PENDING;
+        }
+        if (
+          bits & PENDING &&
+          updateLock(
+            slot,
+            (state) =>
+              (state & SHARED_MASK) === 1 ? state + EXCLUSIVE : null,
+          )
+        ) {
+          bits |= EXCLUSIVE;
+        }
+      }
+      held.set(rid, bits);
+      return lockLevel(bits);
+    },
+    // Release locks on the given file, down to the given level
+    js_unlock: (rid, level) => {
+      const bits = held.get(rid);
+      release(
+        rid,
+        (bits & (RESERVED | PENDING | EXCLUSIVE)) |
+          (level === 0 ? bits & SHARED : 0),
+      );
+    },
+    // Determine if any connection holds a reserved or greater lock
+    js_check_reserved: (rid) => {
+      const state = Atomics.load(locks, slots.get(rid));
+      return state & (RESERVED | PENDING | EXCLUSIVE) ? 1 : 0;
+    },
+    // Claim the WAL index of the given file, returns 1
+    // if it is not claimed by a different file handle
+    js_shm_claim: (rid) => {
+      const owner = owners.get(rid);
+      const claim = Atomics.compareExchange(
+        locks,
+        WAL_CLAIMS + slots.get(rid),
+        0,
+        owner,
+      );
+      return claim === 0 || claim === owner ? 1 : 0;
+    },
+    // Release the WAL index of the given file
+    js_shm_release: (rid) => {
+      releaseClaim(rid);
+    },
+    // Block the thread for the given number of ms
+    js_sleep: (ms) => {
+      Atomics.wait(sleeper, 0, 0, ms);
+    },
     // Return current time in ms since UNIX epoch
     js_time: () => {
       return Date.now();
     },
+    // Return high resolution time in ms, used for profiling
+    js_now: () => {
+      return performance.now();
+    },
+    // Pass a traced statement and its run time in ms to the hook
+    js_trace: (sql_ptr, ms) => {
+      const hook = traceHooks.get(inst.exports);
+      if (hook) {
+        hook(getStr(inst.exports, sql_ptr), ms);
+      }
+    },
     // Determine if a path exists
     js_exists: (path_ptr) => {
       const path = getStr(inst.exports, path_ptr);
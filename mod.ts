@@ -1,3 +1,4 @@
 export { DB } from "./src/db.ts";
+export { AsyncDB } from "./src/async.ts";
 export { Empty } from "./src/rows.ts";
 export { Status } from "./src/constants.ts";
@@ -0,0 +1,278 @@
+import SqliteError from "./error.ts";
+import { QueryParam } from "./query.ts";
+import { getLockTable } from "../build/vfs.js";
+
+interface Request {
+  rows: any[][];
+  // Receives batches as they arrive, instead of collecting them
+  onRows?: (rows: any[][]) => void;
+  resolve: (rows: any[][]) => void;
+  reject: (error: SqliteError) => void;
+}
+
+// A database connection running in a worker
+class Connection {
+  private _worker: Worker;
+  private _requests: Map<number, Request>;
+  private _nextId: number;
+  private _ready: Promise<any[][]>;
+  private _pending: number;
+
+  constructor(path: string, readonly: boolean) {
+    this._worker = new Worker(new URL("./worker.ts", import.meta.url).href, {
+      type: "module",
+      deno: true,
+    } as any);
+    this._requests = new Map();
+    this._nextId = 0;
+    this._pending = 0;
+    this._worker.onmessage = (event) => this._receive(event.data);
+    // If opening fails, the worker is stopped and the
+    // error is raised by all later requests
+    this._ready = this._request(
+      { op: "open", path, readonly, locks: getLockTable() },
+    );
+    this._ready.catch(() => this._worker.terminate());
+  }
+
+  // Number of requests which are not yet answered,
+  // including ones still waiting for the worker to open
+  get pending(): number {
+    return this._pending;
+  }
+
+  send(
+    message: object,
+    onRows?: (rows: any[][]) => void,
+  ): Promise<any[][]> {
+    this._pending++;
+    const settled = () => this._pending--;
+    const result = this._ready.then(() => this._request(message, onRows));
+    result.then(settled, settled);
+    return result;
+  }
+
+  // Close the database and stop the worker, once
+  // all requests sent so far are answered
+  async close() {
+    try {
+      await this._ready;
+    } catch {
+      // The worker was stopped when opening failed
+      return;
+    }
+    try {
+      await this._request({ op: "close" });
+    } finally {
+      this._worker.terminate();
+    }
+  }
+
+  private _request(
+    message: object,
+    onRows?: (rows: any[][]) => void,
+  ): Promise<any[][]> {
+    const id = this._nextId++;
+    return new Promise((resolve, reject) => {
+      this._requests.set(id, { rows: [], onRows, resolve, reject });
+      this._worker.postMessage({ id, ...message });
+    });
+  }
+
+  private _receive({ id, rows, done, error }: any) {
+    const request = this._requests.get(id)!;
+    if (error !== undefined) {
+      this._requests.delete(id);
+      request.reject(new SqliteError(error.message, error.code));
+      return;
+    }
+    if (request.onRows) {
+      if (rows.length) {
+        request.onRows(rows);
+      }
+    } else {
+      for (const row of rows) {
+        request.rows.push(row);
+      }
+    }
+    if (done) {
+      this._requests.delete(id);
+      request.resolve(request.rows);
+    }
+  }
+}
+
+export class AsyncDB {
+  private _writer: Connection;
+  private _readers: Connection[];
+  private _open: boolean;
+
+  /**
+   * AsyncDB
+   *
+   * Open a database in a worker, so queries do
+   * not block the calling thread. The returned
+   * object offers a promise based interface,
+   * similar to `DB`.
+   *
+   * If `readers` is bigger than zero, the given
+   * number of additional read-only connections
+   * are opened in separate workers. Queries run
+   * using `AsyncDB.read` are spread between them,
+   * so they can run in parallel.
+   *
+   * !> Read-only connections require a database
+   * file, they can not be used with in-memory
+   * databases.
+   */
+  constructor(path: string = ":memory:", readers: number = 0) {
+    if (readers > 0 && (path === ":memory:" || path === "")) {
+      throw new SqliteError("Readers require a database file.");
+    }
+    this._writer = new Connection(path, false);
+    this._readers = [];
+    this._open = true;
+    for (let i = 0; i < readers; i++) {
+      this._readers.push(new Connection(path, true));
+    }
+  }
+
+  /**
+   * AsyncDB.query
+   *
+   * Run a query, see `DB.query`. This resolves
+   * to an array of all rows returned by the query.
+   * Rows are sent from the worker in batches, while
+   * the query is still running, but are buffered
+   * until it finishes. Use `AsyncDB.stream` to
+   * process large results as they arrive.
+   *
+   * Queries run in the order in which they are
+   * made.
+   */
+  query(sql: string, values?: object | QueryParam[]): Promise<any[][]> {
+    if (!this._open) {
+      return Promise.reject(new SqliteError("Database was closed."));
+    }
+    return this._writer.send({ op: "query", sql, values });
+  }
+
+  /**
+   * AsyncDB.stream
+   *
+   * Run a query like `AsyncDB.query`, but yield
+   * the rows in batches as soon as they are sent
+   * by the worker:
+   *
+   *     for await (const rows of db.stream(sql)) {
+   *       // ...
+   *     }
+   *
+   * The worker does not wait for the batches to be
+   * consumed, so they are queued if the loop is
+   * slower than the query. The query always runs to
+   * completion, even if the loop is left early.
+   */
+  async *stream(
+    sql: string,
+    values?: object | QueryParam[],
+  ): AsyncGenerator<any[][]> {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    const batches: any[][][] = [];
+    let finished = false;
+    let error: SqliteError | null = null;
+    let wake: (() => void) | null = null;
+    const notify = () => {
+      if (wake) {
+        wake();
+        wake = null;
+      }
+    };
+    this._writer.send({ op: "query", sql, values }, (rows) => {
+      batches.push(rows);
+      notify();
+    }).then(
+      () => {
+        finished = true;
+        notify();
+      },
+      (e) => {
+        error = e;
+        finished = true;
+        notify();
+      },
+    );
+
+    for (;;) {
+      if (batches.length) {
+        yield batches.shift()!;
+      } else if (finished) {
+        break;
+      } else {
+        await new Promise<void>((resolve) => wake = resolve);
+      }
+    }
+    if (error) {
+      throw error;
+    }
+  }
+
+  /**
+   * AsyncDB.busyTimeout
+   *
+   * Set the busy timeout of all connections,
+   * see `DB.busyTimeout`.
+   */
+  async busyTimeout(ms: number) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    await Promise.all(
+      [this._writer, ...this._readers].map((connection) =>
+        connection.send({ op: "busyTimeout", ms })
+      ),
+    );
+  }
+
+  /**
+   * AsyncDB.read
+   *
+   * Run a read-only query on the least busy of
+   * the read-only connections. If there are no
+   * read-only connections, this is the same as
+   * `AsyncDB.query`.
+   *
+   * Reads only see changes made by queries which
+   * have completed.
+   */
+  read(sql: string, values?: object | QueryParam[]): Promise<any[][]> {
+    if (!this._open) {
+      return Promise.reject(new SqliteError("Database was closed."));
+    }
+    let reader = this._writer;
+    for (const connection of this._readers) {
+      if (reader === this._writer || connection.pending < reader.pending) {
+        reader = connection;
+      }
+    }
+    return reader.send({ op: "query", sql, values });
+  }
+
+  /**
+   * AsyncDB.close
+   *
+   * Close all connections and stop the workers,
+   * once all queries made so far have completed.
+   */
+  async close() {
+    if (!this._open) {
+      return;
+    }
+    this._open = false;
+    await Promise.all(
+      [this._writer, ...this._readers].map((connection) => connection.close()),
+    );
+  }
+}
@@ -0,0 +1,159 @@
+import { Status, Values } from "./constants.ts";
+import SqliteError from "./error.ts";
+
+// BLOB data is moved in and out of WASM
+// memory in chunks of this size
+const CHUNK_SIZE = 1 << 16;
+
+export class BlobHandle {
+  private _db: any;
+  private _blob: number;
+  private _buf: number;
+  private _closed: boolean;
+
+  /**
+   * BlobHandle
+   *
+   * A handle to a single BLOB value, which can
+   * be read and written incrementally. This makes
+   * it possible to work with large BLOBs without
+   * loading them into memory all at once.
+   *
+   * This class is not exported from the module
+   * and the only correct way to obtain a
+   * `BlobHandle` object is by calling
+   * `DB.openBlob`.
+   */
+  constructor(db: any, blob: number) {
+    this._db = db;
+    this._blob = blob;
+    this._buf = Values.Null;
+    this._closed = false;
+  }
+
+  /**
+   * BlobHandle.length
+   *
+   * The size of the BLOB in bytes. The size
+   * of a BLOB can not be changed through the
+   * handle.
+   */
+  get length(): number {
+    this._check();
+    return this._db._wasm.blob_bytes(this._blob);
+  }
+
+  /**
+   * BlobHandle.readInto
+   *
+   * Read `buffer.length` bytes, starting at
+   * `offset`, from the BLOB into the given buffer.
+   * Reading past the end of the BLOB throws.
+   */
+  readInto(buffer: Uint8Array, offset: number = 0) {
+    this._check();
+    const wasm = this._db._wasm;
+    const buf = this._scratch();
+    for (let done = 0; done < buffer.length; done += CHUNK_SIZE) {
+      const size = Math.min(CHUNK_SIZE, buffer.length - done);
+      const status = wasm.blob_read(this._blob, buf, size, offset + done);
+      if (status !== Status.SqliteOk) {
+        throw this._db._error(status);
+      }
+      buffer.set(new Uint8Array(wasm.memory.buffer, buf, size), done);
+    }
+  }
+
+  /**
+   * BlobHandle.read
+   *
+   * Read `length` bytes starting at `offset`
+   * into a new buffer. By default, everything
+   * from `offset` to the end of the BLOB is read.
+   */
+  read(offset: number = 0, length?: number): Uint8Array {
+    if (length === undefined) {
+      length = this.length - offset;
+    }
+    const buffer = new Uint8Array(length);
+    this.readInto(buffer, offset);
+    return buffer;
+  }
+
+  /**
+   * BlobHandle.write
+   *
+   * Write the given buffer to the BLOB, starting
+   * at `offset`. The handle must have been opened
+   * for writing. Writing past the end of the BLOB
+   * throws, use `zeroblob(N)` to create a BLOB of
+   * the needed size first.
+   */
+  write(buffer: Uint8Array, offset: number = 0) {
+    this._check();
+    const wasm = this._db._wasm;
+    const buf = this._scratch();
+    for (let done = 0; done < buffer.length; done += CHUNK_SIZE) {
+      const size = Math.min(CHUNK_SIZE, buffer.length - done);
+      new Uint8Array(wasm.memory.buffer, buf, size).set(
+        buffer.subarray(done, done + size),
+      );
+      const status = wasm.blob_write(this._blob, buf, size, offset + done);
+      if (status !== Status.SqliteOk) {
+        throw this._db._error(status);
+      }
+    }
+  }
+
+  /**
+   * BlobHandle.reopen
+   *
+   * Move the handle to the BLOB in the same
+   * column of a different row. This is faster
+   * than opening a new handle.
+   */
+  reopen(row: number) {
+    this._check();
+    const status = this._db._wasm.blob_reopen(this._blob, row);
+    if (status !== Status.SqliteOk) {
+      throw this._db._error(status);
+    }
+  }
+
+  /**
+   * BlobHandle.close
+   *
+   * Close the handle. Open handles prevent
+   * the database from being closed, unless
+   * `DB.close` is forced.
+   */
+  close() {
+    if (this._closed) {
+      return;
+    }
+    this._closed = true;
+    this._db._blobs.delete(this);
+    this._db._wasm.free(this._buf);
+    const status = this._db._wasm.blob_close(this._blob);
+    if (status !== Status.SqliteOk) {
+      throw this._db._error(status);
+    }
+  }
+
+  private _check() {
+    if (this._closed) {
+      throw new SqliteError("Blob was closed.");
+    }
+  }
+
+  // Buffer in WASM memory used to move data
+  private _scratch(): number {
+    if (this._buf === Values.Null) {
+      this._buf = this._db._wasm.malloc(CHUNK_SIZE);
+      if (this._buf === Values.Null) {
+        throw new SqliteError("Out of memory.");
+      }
+    }
+    return this._buf;
+  }
+}
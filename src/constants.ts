@@ -47,3 +47,37 @@ export enum Values {
   Error = -1,
   Null = 0,
 }
+
+// Counters for sqlite3_status64
+export enum StatusOps {
+  MemoryUsed = 0,
+  PageCacheUsed = 1,
+  PageCacheOverflow = 2,
+  MallocSize = 5,
+  PageCacheSize = 7,
+  MallocCount = 9,
+}
+
+// Counters for sqlite3_db_status
+export enum DBStatusOps {
+  LookasideUsed = 0,
+  CacheUsed = 1,
+  SchemaUsed = 2,
+  StmtUsed = 3,
+  LookasideHit = 4,
+  LookasideMissSize = 5,
+  LookasideMissFull = 6,
+  CacheHit = 7,
+  CacheMiss = 8,
+}
+
+// Counters for sqlite3_stmt_status
+export enum StmtStatusOps {
+  FullscanStep = 1,
+  Sort = 2,
+  Autoindex = 3,
+  VMStep = 4,
+  Reprepare = 5,
+  Run = 6,
+  MemUsed = 99,
+}
@@ -1,24 +1,82 @@
 import instantiate from "../build/sqlite.js";
-import { getStr, setStr, setArr } from "./wasm.ts";
-import { Status, Values } from "./constants.ts";
+import { setTraceHook } from "../build/vfs.js";
+import { countCalls, getStr, setStr } from "./wasm.ts";
+import { DBStatusOps, Status, StatusOps, Values } from "./constants.ts";
 import SqliteError from "./error.ts";
-import { Rows, Empty } from "./rows.ts";
-
-// Possible parameters to be bound to a query
-type QueryParam =
-  | boolean
-  | number
-  | bigint
-  | string
-  | null
-  | undefined
-  | Date
-  | Uint8Array;
+import { Rows } from "./rows.ts";
+import { PreparedQuery, QueryParam, StatementStats } from "./query.ts";
+import { BlobHandle } from "./blob.ts";
+
+// Possible checkpoint modes, see `DB.checkpoint`
+type CheckpointMode = "passive" | "full" | "restart" | "truncate";
+
+// Memory statistics, see `DB.memoryStats`
+export interface MemoryStats {
+  memoryUsed: number;
+  memoryHighwater: number;
+  mallocCount: number;
+  largestAlloc: number;
+  pageCacheUsed: number;
+  pageCacheOverflow: number;
+  lookasideUsed: number;
+  lookasideHighwater: number;
+  lookasideHits: number;
+  lookasideMisses: number;
+  cacheUsed: number;
+  cacheHits: number;
+  cacheMisses: number;
+  schemaUsed: number;
+  statementsUsed: number;
+}
+
+// File I/O statistics, see `DB.ioStats`. The
+// order matches `VfsStats` in build/src/stats.h
+const IO_STATS_FIELDS = [
+  "reads",
+  "readBytes",
+  "writes",
+  "writeBytes",
+  "syncs",
+  "sizeCalls",
+  "truncates",
+  "opens",
+  "locks",
+  "cacheHits",
+  "cacheMisses",
+  "ioTime",
+] as const;
+
+export type IOStats = Record<typeof IO_STATS_FIELDS[number], number>;
+
+// Maximum number of prepared statements kept
+// around by `DB.query`
+const STATEMENT_CACHE_SIZE = 64;
+
+// Offset of the file format version bytes in the database
+// header, these are 2 for databases in WAL mode
+const HEADER_VERSION = 18;
+
+// Images are kept in memory, where there is no write-ahead
+// log, so WAL databases are converted to rollback mode
+function clearWalHeader(image: Uint8Array) {
+  if (image.length >= HEADER_VERSION + 2 && image[HEADER_VERSION] === 2) {
+    image[HEADER_VERSION] = 1;
+    image[HEADER_VERSION + 1] = 1;
+  }
+}
 
 export class DB {
   private _wasm: any;
   private _open: boolean;
   private _transactions: Set<Rows>;
+  private _queries: Set<PreparedQuery>;
+  private _cache: Map<string, PreparedQuery>;
+  private _blobs: Set<BlobHandle>;
+  private _exports: any;
+  private _counting: any;
+  private _profile: boolean;
+  private _calls: Map<string, number>;
+  private _statementStats: Map<string, StatementStats>;
 
   /**
    * DB
@@ -29,16 +87,27 @@ export class DB {
    * already exist.
    *
    * The default opens an in-memory database.
+   *
+   * If `readonly` is true, the database is opened
+   * read-only and must already exist.
    */
-  constructor(path: string = ":memory:") {
+  constructor(path: string = ":memory:", readonly: boolean = false) {
     this._wasm = instantiate().exports;
+    this._exports = this._wasm;
+    this._counting = null;
+    this._profile = false;
+    this._calls = new Map();
+    this._statementStats = new Map();
     this._open = false;
     this._transactions = new Set();
+    this._queries = new Set();
+    this._cache = new Map();
+    this._blobs = new Set();
 
     // Try to open the database
     let status;
     setStr(this._wasm, path, (ptr) => {
-      status = this._wasm.open(ptr);
+      status = this._wasm.open(ptr, readonly ? 1 : 0);
     });
     if (status !== Status.SqliteOk) {
       throw this._error();
@@ -114,108 +183,326 @@ export class DB {
     if (!this._open) {
       throw new SqliteError("Database was closed.");
     }
+    return this._cachedQuery(sql).query(values);
+  }
+
+  /**
+   * DB.executeMany
+   *
+   * Run a query once for every row of positional
+   * parameters. This is much faster than calling
+   * `DB.query` for every row and is meant for
+   * loading large amounts of data.
+   *
+   *     db.executeMany("INSERT INTO users (name, balance) VALUES (?, ?)", rows);
+   *
+   * All rows are run inside a single transaction,
+   * unless a transaction is already open. See
+   * `PreparedQuery.executeMany`.
+   */
+  executeMany(sql: string, rows: QueryParam[][]) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    this._cachedQuery(sql).executeMany(rows);
+  }
+
+  /**
+   * DB.executeColumns
+   *
+   * Like `DB.executeMany`, but the parameters are
+   * given as one array per column, which can be a
+   * typed array. See `PreparedQuery.executeColumns`.
+   *
+   *     db.executeColumns("INSERT INTO points (x, y) VALUES (?, ?)", [xs, ys]);
+   */
+  executeColumns(sql: string, columns: ArrayLike<QueryParam>[]) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    this._cachedQuery(sql).executeColumns(columns);
+  }
+
+  /**
+   * DB.prepareQuery
+   *
+   * Prepare a query, which can be run many
+   * times with different parameters. The SQL
+   * is parsed only once, which makes this
+   * faster than repeated calls to `DB.query`.
+   *
+   *     const insert = db.prepareQuery("INSERT INTO users (name) VALUES (?)");
+   *     for (const name of names) insert.query([name]);
+   *     insert.finalize();
+   *
+   * Parameters are bound exactly like they
+   * are for `DB.query`.
+   *
+   * The returned query should be finalized by
+   * calling `.finalize()` once it is no longer
+   * needed. Any queries which are still open are
+   * finalized when the database is closed.
+   *
+   * ?> `DB.query` keeps a small cache of prepared
+   * queries, so repeated queries with the same
+   * SQL text already avoid most of the cost of
+   * preparing the statement.
+   */
+  prepareQuery(sql: string): PreparedQuery {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
 
-    // Prepare sqlite query statement
     let stmt: number = Values.Null;
-    setStr(this._wasm, sql, (ptr) => {
-      stmt = this._wasm.prepare(ptr);
+    setStr(this._wasm, sql, (ptr, len) => {
+      stmt = this._wasm.prepare(ptr, len);
     });
     if (stmt === Values.Null) {
       throw this._error();
     }
 
-    // Prepare parameter array
-    let parameters: any[] = [];
-    if (Array.isArray(values)) {
-      parameters = values;
-    } else if (typeof values === "object") {
-      // Resolve parameter index for named values
-      for (const key of Object.keys(values)) {
-        let idx = Values.Error;
-        // Prepend ':' to name, if it does not have a special starting character
-        let name = key;
-        if (name[0] !== ":" && name[0] !== "@" && name[0] !== "$") {
-          name = `:${name}`;
-        }
-        setStr(this._wasm, name, (ptr) => {
-          idx = this._wasm.bind_parameter_index(stmt, ptr);
+    const query = new PreparedQuery(this, stmt, sql);
+    this._queries.add(query);
+    return query;
+  }
+
+  /**
+   * DB.openBlob
+   *
+   * Open the BLOB stored in the given table, column
+   * and row (identified by its `rowid`) for incremental
+   * reading and writing. This is useful for large BLOBs,
+   * which should not be loaded into memory all at once.
+   *
+   *     const blob = db.openBlob("files", "data", id);
+   *     const header = blob.read(0, 16);
+   *     blob.close();
+   *
+   * If `write` is true, the handle can also be used
+   * to write to the BLOB. The `schema` is the name
+   * of the database containing the table, this is
+   * `main` unless other databases are attached.
+   *
+   * The returned handle must be closed by calling
+   * `.close()`.
+   */
+  openBlob(
+    table: string,
+    column: string,
+    row: number,
+    write: boolean = false,
+    schema: string = "main",
+  ): BlobHandle {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+
+    let blob: number = Values.Null;
+    setStr(this._wasm, schema, (schemaPtr) => {
+      setStr(this._wasm, table, (tablePtr) => {
+        setStr(this._wasm, column, (columnPtr) => {
+          blob = this._wasm.blob_open(
+            schemaPtr,
+            tablePtr,
+            columnPtr,
+            row,
+            write ? 1 : 0,
+          );
         });
-        if (idx === Values.Error) {
-          this._wasm.finalize(stmt);
-          throw new SqliteError(`No parameter named '${name}'.`);
-        }
-        parameters[idx - 1] = (values as any)[key];
-      }
+      });
+    });
+    if (blob === Values.Null) {
+      throw this._error();
     }
 
-    // Bind parameters
-    for (let i = 0; i < parameters.length; i++) {
-      let value = parameters[i];
-      let status;
-      switch (typeof value) {
-        case "boolean":
-          value = value ? 1 : 0;
-        // fall through
-        case "number":
-          if (Math.floor(value) === value) {
-            status = this._wasm.bind_int(stmt, i + 1, value);
-          } else {
-            status = this._wasm.bind_double(stmt, i + 1, value);
-          }
-          break;
-        case "bigint":
-          // bigint is bound as a string and converted to i64 on C side
-          setStr(this._wasm, value.toString(), (ptr) => {
-            status = this._wasm.bind_big_int(stmt, i + 1, ptr);
-          });
-          break;
-        case "string":
-          setStr(this._wasm, value, (ptr) => {
-            status = this._wasm.bind_text(stmt, i + 1, ptr);
-          });
-          break;
-        default:
-          if (value instanceof Date) {
-            // Dates are allowed and bound to TEXT, formatted `YYYY-MM-DDTHH:MM:SS.SSSZ`
-            setStr(this._wasm, value.toISOString(), (ptr) => {
-              status = this._wasm.bind_text(stmt, i + 1, ptr);
-            });
-          } else if (value instanceof Uint8Array) {
-            // Uint8Arrays are allowed and bound to BLOB
-            setArr(this._wasm, value, (ptr) => {
-              status = this._wasm.bind_blob(stmt, i + 1, ptr, value.length);
-            });
-          } else if (value === null || value === undefined) {
-            // Both null and undefined result in a NULL entry
-            status = this._wasm.bind_null(stmt, i + 1);
-          } else {
-            this._wasm.finalize(stmt);
-            throw new SqliteError(`Can not bind ${typeof value}.`);
-          }
-          break;
+    const handle = new BlobHandle(this, blob);
+    this._blobs.add(handle);
+    return handle;
+  }
+
+  /**
+   * DB.checkpoint
+   *
+   * Run a checkpoint, which copies changes from
+   * the write-ahead log back into the database
+   * file. This does nothing, unless the database
+   * uses WAL journal mode:
+   *
+   *     db.query("PRAGMA journal_mode = WAL");
+   *
+   * The mode corresponds to the modes of
+   * `sqlite3_wal_checkpoint_v2` and can be
+   * `passive` (default), `full`, `restart`, or
+   * `truncate`. See https://www.sqlite.org/c3ref/wal_checkpoint_v2.html.
+   *
+   * !> While a database is used in WAL mode, other
+   * `DB`s (or `AsyncDB`s) opening the same file
+   * fail with `SQLITE_BUSY`, until the connection
+   * using WAL is closed.
+   */
+  checkpoint(mode: CheckpointMode = "passive") {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    const modes = ["passive", "full", "restart", "truncate"];
+    if (modes.indexOf(mode) === -1) {
+      throw new SqliteError(`Unknown checkpoint mode '${mode}'.`);
+    }
+    const status = this._wasm.wal_checkpoint(modes.indexOf(mode));
+    if (status !== Status.SqliteOk) {
+      throw this._error(status);
+    }
+  }
+
+  /**
+   * DB.autoCheckpoint
+   *
+   * Set the number of frames in the write-ahead
+   * log after which a checkpoint is run automatically.
+   * The SQLite default is 1000. A value of zero
+   * or less turns automatic checkpoints off.
+   */
+  autoCheckpoint(frames: number) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    const status = this._wasm.wal_autocheckpoint(frames);
+    if (status !== Status.SqliteOk) {
+      throw this._error(status);
+    }
+  }
+
+  /**
+   * DB.busyTimeout
+   *
+   * Set how long a query waits for locks held
+   * by other connections to the same file in
+   * milliseconds, before it fails with
+   * `SQLITE_BUSY`. The default is 5000. A
+   * value of zero or less fails immediately.
+   */
+  busyTimeout(ms: number) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    const status = this._wasm.busy_timeout(ms);
+    if (status !== Status.SqliteOk) {
+      throw this._error(status);
+    }
+  }
+
+  /**
+   * DB.serialize
+   *
+   * Return the contents of the database as
+   * a single buffer. The buffer is identical
+   * to the database file, so this can be used
+   * to take snapshots of in-memory databases:
+   *
+   *     const image = db.serialize();
+   *     await Deno.writeFile("snapshot.db~", image);
+   *     await Deno.rename("snapshot.db~", "snapshot.db");
+   *
+   * The `schema` is the name of the database to
+   * serialize, this is `main` unless other databases
+   * are attached. Images of databases in WAL mode
+   * are marked as using rollback journals, and empty
+   * databases return an empty buffer.
+   */
+  serialize(schema: string = "main"): Uint8Array {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+
+    let image: Uint8Array | undefined;
+    setStr(this._wasm, schema, (ptr) => {
+      // Deserialized databases can be copied out directly,
+      // otherwise SQLite has to assemble the image first
+      let owned = false;
+      let imagePtr = this._wasm.serialize(ptr, 1);
+      if (imagePtr === Values.Null) {
+        owned = true;
+        imagePtr = this._wasm.serialize(ptr, 0);
+      }
+      if (imagePtr === Values.Null) {
+        if (this._wasm.get_status() === Status.SqliteOk) {
+          image = new Uint8Array(0);
+        }
+        return;
       }
-      if (status !== Status.SqliteOk) {
-        this._wasm.finalize(stmt);
-        throw this._error(status);
+      const size = this._wasm.get_serialized_size();
+      image = new Uint8Array(this._wasm.memory.buffer, imagePtr, size).slice();
+      if (owned) {
+        this._wasm.image_free(imagePtr);
       }
+      clearWalHeader(image);
+    });
+    if (image === undefined) {
+      throw this._error();
     }
+    return image;
+  }
 
-    // Step once to handle case where result is empty
-    const status = this._wasm.step(stmt);
-    switch (status) {
-      case Status.SqliteDone:
-        this._wasm.finalize(stmt);
-        return Empty;
-        break;
-      case Status.SqliteRow:
-        const transaction = new Rows(this, stmt);
-        this._transactions.add(transaction);
-        return transaction;
-        break;
-      default:
-        this._wasm.finalize(stmt);
-        throw this._error(status);
-        break;
+  /**
+   * DB.deserialize
+   *
+   * Replace the database with the contents of
+   * the given buffer, which must hold a database
+   * file. The database is then kept in memory,
+   * without reading from or writing to disk:
+   *
+   *     const db = new DB();
+   *     db.deserialize(await Deno.readFile("snapshot.db"));
+   *
+   * If `readonly` is true, the database can not
+   * be changed. Otherwise, it can grow beyond the
+   * size of the buffer. The buffer is copied and
+   * can be reused once this returns.
+   *
+   * This fails if there are open `Rows` or BLOB
+   * handles for the database.
+   *
+   * !> Changes to a database file in WAL mode are
+   * kept in its `-wal` file until they are copied
+   * back by a checkpoint (see `DB.checkpoint`), so
+   * such files must be checkpointed before they
+   * are read from disk.
+   */
+  deserialize(
+    image: Uint8Array,
+    readonly: boolean = false,
+    schema: string = "main",
+  ) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+
+    // SQLite takes ownership of the copy and frees it when
+    // the database is closed or replaced, the wrapper frees
+    // it if deserializing fails
+    const imagePtr = this._wasm.image_alloc(Math.max(image.length, 1));
+    if (imagePtr === Values.Null) {
+      throw this._error();
+    }
+    const copy = new Uint8Array(
+      this._wasm.memory.buffer,
+      imagePtr,
+      image.length,
+    );
+    copy.set(image);
+    clearWalHeader(copy);
+
+    let status = Status.Unknown;
+    setStr(this._wasm, schema, (ptr) => {
+      status = this._wasm.deserialize(
+        ptr,
+        imagePtr,
+        image.length,
+        readonly ? 1 : 0,
+      );
+    });
+    if (status !== Status.SqliteOk) {
+      throw this._error(status);
     }
   }
 
@@ -227,7 +514,7 @@ export class DB {
    * resources.
    *
    * If force is specified, any on-going transactions
-   * will be closed.
+   * and open BLOB handles will be closed.
    */
   close(force: boolean = false) {
     if (!this._open) {
@@ -237,6 +524,15 @@ export class DB {
       for (const transaction of this._transactions) {
         transaction.done();
       }
+      for (const blob of this._blobs) {
+        blob.close();
+      }
+    }
+    if (this._transactions.size === 0) {
+      // Prepared statements would block closing
+      for (const query of this._queries) {
+        query.finalize();
+      }
     }
     if (this._wasm.close() !== Status.SqliteOk) {
       throw this._error();
@@ -257,6 +553,229 @@ export class DB {
     return this._wasm.last_insert_rowid();
   }
 
+  /**
+   * DB.memoryStats
+   *
+   * Report how much memory SQLite uses. Memory
+   * figures are in bytes. The memory counters
+   * are global to the WASM instance, the lookaside
+   * and cache counters are for this connection.
+   *
+   * If `reset` is true, highwater marks and hit/
+   * miss counters are reset after being read.
+   */
+  memoryStats(reset: boolean = false): MemoryStats {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    const global = (op: StatusOps, highwater = false) =>
+      this._wasm.status64(op, highwater ? 1 : 0, reset ? 1 : 0);
+    const local = (op: DBStatusOps, highwater = false) =>
+      this._wasm.db_status(op, highwater ? 1 : 0, reset ? 1 : 0);
+    // Highwater marks are read first, since reading
+    // the current value with reset clears them
+    return {
+      memoryHighwater: global(StatusOps.MemoryUsed, true),
+      memoryUsed: global(StatusOps.MemoryUsed),
+      mallocCount: global(StatusOps.MallocCount),
+      largestAlloc: global(StatusOps.MallocSize, true),
+      pageCacheUsed: global(StatusOps.PageCacheUsed),
+      pageCacheOverflow: global(StatusOps.PageCacheOverflow),
+      lookasideHighwater: local(DBStatusOps.LookasideUsed, true),
+      lookasideUsed: local(DBStatusOps.LookasideUsed),
+      lookasideHits: local(DBStatusOps.LookasideHit, true),
+      lookasideMisses: local(DBStatusOps.LookasideMissSize, true) +
+        local(DBStatusOps.LookasideMissFull, true),
+      cacheUsed: local(DBStatusOps.CacheUsed),
+      cacheHits: local(DBStatusOps.CacheHit),
+      cacheMisses: local(DBStatusOps.CacheMiss),
+      schemaUsed: local(DBStatusOps.SchemaUsed),
+      statementsUsed: local(DBStatusOps.StmtUsed),
+    };
+  }
+
+  /**
+   * DB.lookaside
+   *
+   * Replace the lookaside memory of the connection,
+   * which serves small allocations without calling
+   * into the allocator. `slotSize` is the size of
+   * each slot in bytes, and a `slots` count of zero
+   * turns lookaside off.
+   *
+   * This must be called before any queries are
+   * run, since it fails with `SQLITE_BUSY` while
+   * lookaside memory is in use.
+   */
+  lookaside(slotSize: number, slots: number) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    const status = this._wasm.lookaside(slotSize, slots);
+    if (status !== Status.SqliteOk) {
+      throw this._error(status);
+    }
+  }
+
+  /**
+   * DB.profile
+   *
+   * Turn profiling on or off. While profiling,
+   * calls into the WASM module are counted (see
+   * `DB.callStats`), counters of every query
+   * which runs are collected (see `DB.statementStats`)
+   * and file I/O is timed (see `DB.ioStats`).
+   *
+   * Profiling makes queries slower and should
+   * not be left on in production.
+   */
+  profile(enabled: boolean = true) {
+    if (enabled === this._profile) {
+      return;
+    }
+    this._profile = enabled;
+    this._exports.set_io_timing(enabled ? 1 : 0);
+    if (enabled && this._counting === null) {
+      this._counting = countCalls(this._exports, this._calls);
+    }
+    this._wasm = enabled ? this._counting : this._exports;
+  }
+
+  /**
+   * DB.callStats
+   *
+   * Return the number of calls made into the WASM
+   * module for each exported function, while
+   * profiling was turned on. If `reset` is true,
+   * the counts are reset afterwards.
+   */
+  callStats(reset: boolean = false): Map<string, number> {
+    const calls = new Map(this._calls);
+    if (reset) {
+      this._calls.clear();
+    }
+    return calls;
+  }
+
+  /**
+   * DB.statementStats
+   *
+   * Return the counters collected for each query,
+   * while profiling was turned on. The counters
+   * are those of `PreparedQuery.stats`, added up
+   * over all runs of the same SQL. If `reset` is
+   * true, the counters are reset afterwards.
+   */
+  statementStats(reset: boolean = false): Map<string, StatementStats> {
+    const stats = new Map();
+    for (const [sql, counters] of this._statementStats) {
+      stats.set(sql, { ...counters });
+    }
+    if (reset) {
+      this._statementStats.clear();
+    }
+    return stats;
+  }
+
+  /**
+   * DB.ioStats
+   *
+   * Return counters for file I/O done by the
+   * database, e.g. the number of reads and writes,
+   * bytes moved, syncs and hits of the block
+   * cache. `ioTime` is the time in ms spent in
+   * file operations, which is only measured
+   * while profiling (see `DB.profile`).
+   *
+   * The other counters are always collected. If
+   * `reset` is true, they are reset afterwards.
+   */
+  ioStats(reset: boolean = false): IOStats {
+    const ptr = this._exports.get_vfs_stats();
+    const values = new Float64Array(
+      this._exports.memory.buffer,
+      ptr,
+      IO_STATS_FIELDS.length,
+    );
+    const stats: any = {};
+    IO_STATS_FIELDS.forEach((field, i) => stats[field] = values[i]);
+    if (reset) {
+      this._exports.reset_vfs_stats();
+    }
+    return stats as IOStats;
+  }
+
+  /**
+   * DB.trace
+   *
+   * Call `hook` with the SQL and run time in ms
+   * of every statement, once it finished running.
+   * Passing `null` turns tracing off.
+   *
+   * !> Tracing is only available if the module
+   * was built with `make SQLITE_TRACE=1`.
+   */
+  trace(hook: ((sql: string, ms: number) => void) | null) {
+    if (!this._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    const status = this._wasm.trace(hook ? 1 : 0);
+    if (status === Status.SqliteMisuse) {
+      throw new SqliteError(
+        "Tracing is not available, SQLite was built with SQLITE_OMIT_TRACE.",
+        status,
+      );
+    } else if (status !== Status.SqliteOk) {
+      throw this._error(status);
+    }
+    setTraceHook(this._exports, hook);
+  }
+
+  // Add counters of a finished statement run to the
+  // collected statement stats
+  private _recordStats(sql: string, stats: StatementStats) {
+    const total = this._statementStats.get(sql);
+    if (total === undefined) {
+      this._statementStats.set(sql, { ...stats });
+      return;
+    }
+    total.fullscanSteps += stats.fullscanSteps;
+    total.sorts += stats.sorts;
+    total.autoindexRows += stats.autoindexRows;
+    total.vmSteps += stats.vmSteps;
+    total.reprepares += stats.reprepares;
+    total.runs += stats.runs;
+    total.memoryUsed = stats.memoryUsed;
+  }
+
+  // Return cached prepared query for the given SQL,
+  // the cache is bounded and evicts the least recently
+  // used statement
+  private _cachedQuery(sql: string): PreparedQuery {
+    const cached = this._cache.get(sql);
+    if (cached !== undefined) {
+      this._cache.delete(sql);
+      this._cache.set(sql, cached);
+      if (!cached._active) {
+        return cached;
+      }
+      // Statement is in use by open rows, so we
+      // use a one-off statement instead
+      const query = this.prepareQuery(sql);
+      query._transient = true;
+      return query;
+    }
+
+    const query = this.prepareQuery(sql);
+    this._cache.set(sql, query);
+    if (this._cache.size > STATEMENT_CACHE_SIZE) {
+      const [oldest, evicted] = this._cache.entries().next().value;
+      this._cache.delete(oldest);
+      evicted._evict();
+    }
+    return query;
+  }
+
   private _error(code?: number): SqliteError {
     if (code === undefined) {
       code = this._wasm.get_status() as number;
@@ -0,0 +1,525 @@
+import { setStr, copyArr } from "./wasm.ts";
+import { Status, StmtStatusOps, Values, Types } from "./constants.ts";
+import SqliteError from "./error.ts";
+import { Rows, Empty } from "./rows.ts";
+
+// Possible parameters to be bound to a query
+export type QueryParam =
+  | boolean
+  | number
+  | bigint
+  | string
+  | null
+  | undefined
+  | Date
+  | Uint8Array;
+
+// Counters of a statement, see `PreparedQuery.stats`
+export interface StatementStats {
+  fullscanSteps: number;
+  sorts: number;
+  autoindexRows: number;
+  vmSteps: number;
+  reprepares: number;
+  runs: number;
+  memoryUsed: number;
+}
+
+// Batches passed to `run_rows` are split into
+// chunks of roughly this many bytes
+const BATCH_BYTES = 1 << 20;
+
+const encoder = new TextEncoder();
+
+// Range of SQLite INTEGER values
+const INT64_MIN = -(2n ** 63n);
+const INT64_MAX = 2n ** 63n - 1n;
+
+export class PreparedQuery {
+  private _db: any;
+  private _stmt: number;
+  private _sql: string;
+  private _rows: Rows | null;
+  private _finalized: boolean;
+  _transient: boolean;
+  private _paramIndex: Map<string, number>;
+  private _buffers: number[];
+
+  /**
+   * PreparedQuery
+   *
+   * A prepared query is an SQL statement, which
+   * is parsed and planned only once and can then
+   * be run many times with different parameters.
+   *
+   * This class is not exported from the module
+   * and the only correct way to obtain a
+   * `PreparedQuery` object is by calling
+   * `DB.prepareQuery`.
+   */
+  constructor(db: any, stmt: number, sql: string) {
+    this._db = db;
+    this._stmt = stmt;
+    this._sql = sql;
+    this._rows = null;
+    this._finalized = false;
+    this._transient = false;
+    this._paramIndex = new Map();
+    this._buffers = [];
+  }
+
+  /**
+   * PreparedQuery.query
+   *
+   * Run the prepared query with the given
+   * parameters. Parameters are bound exactly
+   * like they are for `DB.query` and this
+   * returns an iterable Rows object (or the
+   * Empty row) in the same way.
+   *
+   * A prepared query can only have one set of
+   * open rows at a time. The returned rows must
+   * be fully iterated over or discarded by calling
+   * `.done()` before the query is run again.
+   */
+  query(values?: object | QueryParam[]): Rows {
+    this._check();
+
+    // Prepare parameter array
+    let parameters: any[] = [];
+    if (Array.isArray(values)) {
+      parameters = values;
+    } else if (typeof values === "object") {
+      for (const key of Object.keys(values)) {
+        const idx = this._parameterIndex(key);
+        if (idx === Values.Error) {
+          this._release();
+          throw new SqliteError(`No parameter named '${key}'.`);
+        }
+        parameters[idx - 1] = (values as any)[key];
+      }
+    }
+
+    // Bind parameters
+    for (let i = 0; i < parameters.length; i++) {
+      let value = parameters[i];
+      let status;
+      switch (typeof value) {
+        case "boolean":
+          value = value ? 1 : 0;
+        // fall through
+        case "number":
+          if (Math.floor(value) === value) {
+            status = this._db._wasm.bind_int(this._stmt, i + 1, value);
+          } else {
+            status = this._db._wasm.bind_double(this._stmt, i + 1, value);
+          }
+          break;
+        case "bigint":
+          checkBigInt(value);
+          // bigint is bound as two 32 bit halves and combined on C side
+          status = this._db._wasm.bind_big_int(
+            this._stmt,
+            i + 1,
+            Number(BigInt.asIntN(32, value >> 32n)),
+            Number(BigInt.asUintN(32, value)),
+          );
+          break;
+        case "string":
+          setStr(this._db._wasm, value, (ptr, len) => {
+            status = this._db._wasm.bind_text(this._stmt, i + 1, ptr, len);
+          });
+          break;
+        default:
+          if (value instanceof Date) {
+            // Dates are allowed and bound to TEXT, formatted `YYYY-MM-DDTHH:MM:SS.SSSZ`
+            setStr(this._db._wasm, value.toISOString(), (ptr, len) => {
+              status = this._db._wasm.bind_text(this._stmt, i + 1, ptr, len);
+            });
+          } else if (value instanceof Uint8Array) {
+            // Uint8Arrays are allowed and bound to BLOB, the copy is
+            // kept until the statement is reset, so SQLite does not
+            // need to copy it again
+            let ptr;
+            try {
+              ptr = copyArr(this._db._wasm, value);
+            } catch (error) {
+              this._release();
+              throw error;
+            }
+            this._buffers.push(ptr);
+            status = this._db._wasm.bind_blob(
+              this._stmt,
+              i + 1,
+              ptr,
+              value.length,
+              1,
+            );
+          } else if (value === null || value === undefined) {
+            // Both null and undefined result in a NULL entry
+            status = this._db._wasm.bind_null(this._stmt, i + 1);
+          } else {
+            this._release();
+            throw new SqliteError(`Can not bind ${typeof value}.`);
+          }
+          break;
+      }
+      if (status !== Status.SqliteOk) {
+        const error = this._db._error(status);
+        this._release();
+        throw error;
+      }
+    }
+
+    // Step once to handle case where result is empty
+    const status = this._db._wasm.step(this._stmt);
+    switch (status) {
+      case Status.SqliteDone:
+        this._release();
+        return Empty;
+        break;
+      case Status.SqliteRow:
+        this._rows = new Rows(this._db, this._stmt, this);
+        this._db._transactions.add(this._rows);
+        return this._rows;
+        break;
+      default:
+        const error = this._db._error(status);
+        this._release();
+        throw error;
+        break;
+    }
+  }
+
+  /**
+   * PreparedQuery.executeMany
+   *
+   * Run the prepared query once for every
+   * row of positional parameters. Any rows
+   * returned by the query are discarded.
+   *
+   *     const insert = db.prepareQuery("INSERT INTO users (name, balance) VALUES (?, ?)");
+   *     insert.executeMany([["Peter Parker", 100], ["Clark Kent", 200]]);
+   *
+   * The parameters are moved into WASM memory
+   * in large chunks and the rows are run in a
+   * single transaction, unless a transaction is
+   * already open. If any row fails, that
+   * transaction is rolled back.
+   *
+   * Values are converted in the same way as they
+   * are for `DB.query`.
+   */
+  executeMany(rows: QueryParam[][]) {
+    let cols = 0;
+    for (const row of rows) {
+      cols = Math.max(cols, row.length);
+    }
+    this._executeBatch(rows.length, cols, (r, c) => rows[r][c]);
+  }
+
+  /**
+   * PreparedQuery.executeColumns
+   *
+   * Like `executeMany`, but the parameters are
+   * given as one array per column. The columns
+   * can be typed arrays (e.g. `Float64Array` or
+   * `BigInt64Array`) or regular arrays and must
+   * all have the same length.
+   *
+   *     insert.executeColumns([names, new Float64Array(balances)]);
+   */
+  executeColumns(columns: ArrayLike<QueryParam>[]) {
+    const count = columns.length ? columns[0].length : 0;
+    for (const column of columns) {
+      if (column.length !== count) {
+        throw new SqliteError("Columns must have the same length.");
+      }
+    }
+    this._executeBatch(count, columns.length, (r, c) => columns[c][r]);
+  }
+
+  /**
+   * PreparedQuery.finalize
+   *
+   * Release the prepared statement. The query
+   * can not be used after it was finalized. If
+   * the query has any open rows, these are
+   * discarded as if `.done()` was called.
+   *
+   * Prepared queries which were not finalized
+   * are released automatically when the database
+   * is closed.
+   */
+  finalize() {
+    if (this._finalized) {
+      return;
+    }
+    this._finalized = true;
+    if (this._rows !== null) {
+      this._rows.done();
+    }
+    this._db._wasm.finalize(this._stmt);
+    this._freeBuffers();
+    this._db._queries.delete(this);
+    if (this._db._cache.get(this._sql) === this) {
+      this._db._cache.delete(this._sql);
+    }
+  }
+
+  /**
+   * PreparedQuery.stats
+   *
+   * Return counters which SQLite keeps for the
+   * statement, see `sqlite3_stmt_status`. These
+   * show how much work a query does, e.g. if it
+   * scans a full table or sorts without an index.
+   *
+   * Counters add up over all runs of the query,
+   * unless `reset` is true or profiling is turned
+   * on (see `DB.profile`).
+   */
+  stats(reset: boolean = false): StatementStats {
+    if (this._finalized) {
+      throw new SqliteError("Query was finalized.");
+    }
+    return this._readStats(reset);
+  }
+
+  _readStats(reset: boolean): StatementStats {
+    const status = (op: StmtStatusOps) =>
+      this._db._wasm.stmt_status(this._stmt, op, reset ? 1 : 0);
+    return {
+      fullscanSteps: status(StmtStatusOps.FullscanStep),
+      sorts: status(StmtStatusOps.Sort),
+      autoindexRows: status(StmtStatusOps.Autoindex),
+      vmSteps: status(StmtStatusOps.VMStep),
+      reprepares: status(StmtStatusOps.Reprepare),
+      runs: status(StmtStatusOps.Run),
+      memoryUsed: status(StmtStatusOps.MemUsed),
+    };
+  }
+
+  // Called once the statement is no longer needed
+  // by any rows, resets the statement to be used
+  // again (or releases transient statements)
+  _release() {
+    this._rows = null;
+    if (this._finalized) {
+      return;
+    }
+    if (this._db._profile) {
+      this._db._recordStats(this._sql, this._readStats(true));
+    }
+    if (this._transient) {
+      this.finalize();
+      return;
+    }
+    this._db._wasm.reset(this._stmt);
+    this._db._wasm.clear_bindings(this._stmt);
+    this._freeBuffers();
+  }
+
+  // Free BLOB values, which were bound without copying
+  private _freeBuffers() {
+    for (const ptr of this._buffers) {
+      this._db._wasm.free(ptr);
+    }
+    this._buffers = [];
+  }
+
+  // Mark statement to be finalized once it is
+  // released (immediately if it is not in use)
+  _evict() {
+    this._transient = true;
+    if (this._rows === null) {
+      this.finalize();
+    }
+  }
+
+  private _check() {
+    if (this._finalized) {
+      throw new SqliteError("Query was finalized.");
+    }
+    if (!this._db._open) {
+      throw new SqliteError("Database was closed.");
+    }
+    if (this._rows !== null) {
+      throw new SqliteError("Query has open rows.");
+    }
+  }
+
+  // Run statement for every row, the parameters are
+  // encoded into chunks which are run by `run_rows`
+  private _executeBatch(
+    count: number,
+    cols: number,
+    get: (row: number, col: number) => QueryParam,
+  ) {
+    this._check();
+    const wasm = this._db._wasm;
+    const begin = wasm.get_autocommit() !== 0;
+    if (begin) {
+      this._db.query("BEGIN");
+    }
+
+    let ptr = Values.Null;
+    let capacity = 0;
+    try {
+      for (let first = 0; first < count;) {
+        // Determine size of next chunk
+        let size = 8;
+        let last = first;
+        while (last < count && (last === first || size < BATCH_BYTES)) {
+          for (let c = 0; c < cols; c++) {
+            size += cellSize(get(last, c));
+          }
+          last++;
+        }
+        if (size > capacity) {
+          wasm.free(ptr);
+          ptr = wasm.malloc(size);
+          if (ptr === Values.Null) {
+            throw new SqliteError("Out of memory.");
+          }
+          capacity = size;
+        }
+
+        const view = new DataView(wasm.memory.buffer);
+        const bytes = new Uint8Array(wasm.memory.buffer);
+        view.setInt32(ptr, last - first, true);
+        view.setInt32(ptr + 4, cols, true);
+        let offset = ptr + 8;
+        for (let r = first; r < last; r++) {
+          for (let c = 0; c < cols; c++) {
+            offset = writeCell(view, bytes, offset, get(r, c));
+          }
+        }
+
+        if (wasm.run_rows(this._stmt, ptr) === Values.Error) {
+          throw this._db._error();
+        }
+        first = last;
+      }
+      if (begin) {
+        this._db.query("COMMIT");
+      }
+    } catch (error) {
+      this._release();
+      // SQLite may have rolled back already, e.g. on
+      // conflicts with ON CONFLICT ROLLBACK
+      if (begin && wasm.get_autocommit() === 0) {
+        this._db.query("ROLLBACK");
+      }
+      throw error;
+    } finally {
+      wasm.free(ptr);
+    }
+    this._release();
+  }
+
+  get _active(): boolean {
+    return this._rows !== null;
+  }
+
+  // Resolve index for named parameter, these are
+  // looked up only once per statement
+  private _parameterIndex(key: string): number {
+    let idx = this._paramIndex.get(key);
+    if (idx !== undefined) {
+      return idx;
+    }
+    // Prepend ':' to name, if it does not have a special starting character
+    let name = key;
+    if (name[0] !== ":" && name[0] !== "@" && name[0] !== "$") {
+      name = `:${name}`;
+    }
+    idx = Values.Error;
+    setStr(this._db._wasm, name, (ptr) => {
+      idx = this._db._wasm.bind_parameter_index(this._stmt, ptr);
+    });
+    this._paramIndex.set(key, idx);
+    return idx;
+  }
+}
+
+// Upper bound for the size of a value
+// encoded by `writeCell`
+function cellSize(value: QueryParam): number {
+  if (typeof value === "string") {
+    return 8 + ((3 * value.length + 7) & ~7);
+  } else if (value instanceof Uint8Array) {
+    return 8 + ((value.length + 7) & ~7);
+  } else if (value instanceof Date) {
+    return 8 + 32;
+  } else if (value === null || value === undefined) {
+    return 8;
+  } else {
+    return 16;
+  }
+}
+
+// Values outside of the 64 bit range would silently
+// wrap around when bound, so they are rejected instead.
+function checkBigInt(value: bigint): bigint {
+  if (value < INT64_MIN || value > INT64_MAX) {
+    throw new SqliteError(`Can not bind ${value}, it is out of range.`);
+  }
+  return value;
+}
+
+// Encode value into a batch for `run_rows`, see
+// `build/src/wrapper.c` for the layout. Returns the
+// offset of the next value.
+function writeCell(
+  view: DataView,
+  bytes: Uint8Array,
+  offset: number,
+  value: any,
+): number {
+  let type;
+  let length = 0;
+  let payload = 8;
+  switch (typeof value) {
+    case "boolean":
+      value = value ? 1 : 0;
+    // fall through
+    case "number":
+      type = Math.floor(value) === value ? Types.Integer : Types.Float;
+      view.setFloat64(offset + 8, value, true);
+      break;
+    case "bigint":
+      type = Types.BigInteger;
+      view.setBigInt64(offset + 8, checkBigInt(value), true);
+      break;
+    case "string":
+      type = Types.Text;
+      length = encoder.encodeInto(value, bytes.subarray(offset + 8)).written!;
+      payload = (length + 7) & ~7;
+      break;
+    default:
+      if (value instanceof Date) {
+        // Dates are allowed and bound to TEXT, formatted `YYYY-MM-DDTHH:MM:SS.SSSZ`
+        type = Types.Text;
+        length = encoder.encodeInto(
+          value.toISOString(),
+          bytes.subarray(offset + 8),
+        ).written!;
+        payload = (length + 7) & ~7;
+      } else if (value instanceof Uint8Array) {
+        type = Types.Blob;
+        length = value.length;
+        bytes.set(value, offset + 8);
+        payload = (length + 7) & ~7;
+      } else if (value === null || value === undefined) {
+        type = Types.Null;
+        payload = 0;
+      } else {
+        throw new SqliteError(`Can not bind ${typeof value}.`);
+      }
+      break;
+  }
+  view.setInt32(offset, type, true);
+  view.setInt32(offset + 4, length, true);
+  return offset + 8 + payload;
+}
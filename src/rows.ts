@@ -1,6 +1,12 @@
-import { getStr } from "./wasm.ts";
+import { getStr, decodeStr } from "./wasm.ts";
 import { Status, Values, Types } from "./constants.ts";
 import SqliteError from "./error.ts";
+import { StatementStats } from "./query.ts";
+
+// Rows are read from the statement in batches, which
+// grow from the minimum to the maximum size
+const BATCH_MIN_ROWS = 8;
+const BATCH_MAX_ROWS = 512;
 
 interface ColumnName {
   name: string;
@@ -11,7 +17,13 @@ interface ColumnName {
 export class Rows {
   private _db: any;
   private _stmt: number;
+  private _query: any;
   private _done: boolean;
+  private _batch: any[][];
+  private _batchIdx: number;
+  private _batchRows: number;
+  private _status: number;
+  private _stats: StatementStats | null;
 
   /**
    * Rows
@@ -24,10 +36,16 @@ export class Rows {
    * and the only correct way to obtain a `Rows`
    * object is by making a database query.
    */
-  constructor(db: any, stmt: number) {
+  constructor(db: any, stmt: number, query: any = null) {
     this._db = db;
     this._stmt = stmt;
+    this._query = query;
     this._done = false;
+    this._batch = [];
+    this._batchIdx = 0;
+    this._batchRows = BATCH_MIN_ROWS;
+    this._status = Status.SqliteRow;
+    this._stats = null;
 
     if (!this._db) {
       this._done = true;
@@ -55,10 +73,39 @@ export class Rows {
     if (this._done) {
       return;
     }
-    // Release transaction slot
-    this._db._wasm.finalize(this._stmt);
+    // Release transaction slot and hand the
+    // statement back to the prepared query
     this._db._transactions.delete(this);
     this._done = true;
+    this._batch = [];
+    if (this._db._profile) {
+      this._stats = this._query._readStats(false);
+    }
+    this._query._release();
+  }
+
+  /**
+   * Rows.stats
+   *
+   * Return the counters SQLite keeps for the
+   * statement which produces the rows, see
+   * `PreparedQuery.stats`.
+   *
+   * Once the rows are done, the counters are
+   * only available if profiling is turned on
+   * (see `DB.profile`) and then cover just the
+   * run which produced these rows.
+   */
+  stats(): StatementStats {
+    if (!this._done) {
+      return this._query._readStats(false);
+    }
+    if (this._stats === null) {
+      throw new SqliteError(
+        "Statement stats are only kept when profiling is turned on.",
+      );
+    }
+    return this._stats;
   }
 
   /**
@@ -68,24 +115,78 @@ export class Rows {
    */
   next(): IteratorResult<any[]> {
     if (this._done) return { value: undefined, done: true };
-    // Load row data and advance statement
-    const row = this._get();
-    const status = this._db._wasm.step(this._stmt);
-    switch (status) {
-      case Status.SqliteRow:
-        // NO OP
-        break;
-      case Status.SqliteDone:
-        this.done();
-        break;
-      default:
-        this.done();
-        throw this._db._error(status);
-        break;
+    // Load next batch of rows if needed
+    if (this._batchIdx >= this._batch.length) {
+      this._fetch();
+    }
+    const row = this._batch[this._batchIdx++];
+    if (
+      this._batchIdx >= this._batch.length &&
+      this._status !== Status.SqliteRow
+    ) {
+      // This was the last row
+      const error = this._status === Status.SqliteDone
+        ? null
+        : this._db._error(this._status);
+      this.done();
+      if (error !== null) {
+        throw error;
+      }
     }
     return { value: row, done: false };
   }
 
+  /**
+   * Rows.columnar
+   *
+   * Read all remaining rows and return them
+   * as one array per column, instead of one
+   * array per row.
+   *
+   * Columns which contain only numbers are
+   * returned as a `Float64Array`. Columns which
+   * contain only integers, some of which are
+   * too big to fit in a `number`, are returned
+   * as a `BigInt64Array`. All other columns are
+   * returned as regular arrays.
+   *
+   *     const [ids, balances] = db.query("SELECT id, balance FROM users").columnar();
+   *
+   * This calls `.done()` once all rows are read.
+   */
+  columnar(): Array<Float64Array | BigInt64Array | any[]> {
+    if (this._done) {
+      return [];
+    }
+    const columns: ColumnBuilder[] = [];
+
+    // Rows which were fetched, but not yet returned
+    for (; this._batchIdx < this._batch.length; this._batchIdx++) {
+      const row = this._batch[this._batchIdx];
+      for (let c = 0; c < row.length; c++) {
+        if (columns[c] === undefined) {
+          columns[c] = new ColumnBuilder();
+        }
+        columns[c].push(row[c]);
+      }
+    }
+    this._batch = [];
+    this._batchIdx = 0;
+
+    // Remaining rows are decoded into the columns directly
+    while (this._status === Status.SqliteRow) {
+      readColumns(this._db._wasm, this._step(BATCH_MAX_ROWS), columns);
+    }
+    const error = this._status === Status.SqliteDone
+      ? null
+      : this._db._error(this._status);
+    this.done();
+    if (error !== null) {
+      throw error;
+    }
+    return columns.map((column) => column.finish());
+  }
+
   /**
    * Rows.columns
    *
@@ -130,56 +231,207 @@ export class Rows {
     return this;
   }
 
-  private _get(): any[] {
-    // Get results from row
-    const row = [];
-    // return row;
-    for (
-      let i = 0, c = this._db._wasm.column_count(this._stmt);
-      i < c;
-      i++
-    ) {
-      switch (this._db._wasm.column_type(this._stmt, i)) {
+  private _fetch() {
+    this._batch = readBatch(this._db._wasm, this._step(this._batchRows));
+    this._batchIdx = 0;
+    this._batchRows = Math.min(2 * this._batchRows, BATCH_MAX_ROWS);
+  }
+
+  // Read the next batch of rows, returns the pointer
+  // to the batch in WASM memory
+  private _step(maxRows: number): number {
+    const wasm = this._db._wasm;
+    const ptr = wasm.step_rows(this._stmt, maxRows);
+    this._status = wasm.get_status();
+    if (ptr === Values.Null) {
+      const error = this._db._error(this._status);
+      this.done();
+      throw error;
+    }
+    return ptr;
+  }
+}
+
+// Decode a batch of rows written by `step_rows`, see
+// `build/src/wrapper.c` for the layout
+function readBatch(wasm: any, ptr: number): any[][] {
+  const view = new DataView(wasm.memory.buffer);
+  const bytes = new Uint8Array(wasm.memory.buffer);
+  const rowCount = view.getInt32(ptr, true);
+  const colCount = view.getInt32(ptr + 4, true);
+  const rows = new Array(rowCount);
+  let offset = ptr + 8;
+  for (let r = 0; r < rowCount; r++) {
+    const row = new Array(colCount);
+    for (let c = 0; c < colCount; c++) {
+      const type = view.getInt32(offset, true);
+      const length = view.getInt32(offset + 4, true);
+      offset += 8;
+      switch (type) {
         case Types.Integer:
-          row.push(this._db._wasm.column_int(this._stmt, i));
-          break;
         case Types.Float:
-          row.push(this._db._wasm.column_double(this._stmt, i));
+          row[c] = view.getFloat64(offset, true);
+          offset += 8;
+          break;
+        case Types.BigInteger:
+          row[c] = view.getBigInt64(offset, true);
+          offset += 8;
           break;
         case Types.Text:
-          row.push(
-            getStr(
-              this._db._wasm,
-              this._db._wasm.column_text(this._stmt, i),
-            ),
-          );
+          row[c] = decodeStr(bytes.subarray(offset, offset + length));
+          offset += (length + 7) & ~7;
           break;
-        case Types.Blob: {
-          const ptr = this._db._wasm.column_blob(this._stmt, i);
-          if (ptr === 0) {
-            // Zero pointer results in null
-            row.push(null);
-          } else {
-            const length = this._db._wasm.column_bytes(this._stmt, i);
-            // Slice should copy the bytes, as it makes a shallow copy
-            row.push(
-              new Uint8Array(this._db._wasm.memory.buffer, ptr, length).slice(),
-            );
-          }
+        case Types.Blob:
+          // Slice copies the bytes out of the WASM memory
+          row[c] = bytes.slice(offset, offset + length);
+          offset += (length + 7) & ~7;
           break;
-        }
-        case Types.BigInteger: {
-          const ptr = this._db._wasm.column_text(this._stmt, i);
-          row.push(BigInt(getStr(this._db._wasm, ptr)));
-          break;
-        }
         default:
           // TODO: Differentiate between NULL and not-recognized?
-          row.push(null);
+          row[c] = null;
+          break;
+      }
+    }
+    rows[r] = row;
+  }
+  return rows;
+}
+
+// Decode a batch of rows written by `step_rows` into
+// the given columns, without creating row arrays
+function readColumns(wasm: any, ptr: number, columns: ColumnBuilder[]) {
+  const view = new DataView(wasm.memory.buffer);
+  const bytes = new Uint8Array(wasm.memory.buffer);
+  const rowCount = view.getInt32(ptr, true);
+  const colCount = view.getInt32(ptr + 4, true);
+  for (let c = columns.length; c < colCount; c++) {
+    columns[c] = new ColumnBuilder();
+  }
+  let offset = ptr + 8;
+  for (let r = 0; r < rowCount; r++) {
+    for (let c = 0; c < colCount; c++) {
+      const type = view.getInt32(offset, true);
+      const length = view.getInt32(offset + 4, true);
+      offset += 8;
+      switch (type) {
+        case Types.Integer:
+        case Types.Float:
+          columns[c].pushNumber(view.getFloat64(offset, true));
+          offset += 8;
           break;
+        case Types.BigInteger:
+          columns[c].pushBigInt(view.getBigInt64(offset, true));
+          offset += 8;
+          break;
+        case Types.Text:
+          columns[c].push(decodeStr(bytes.subarray(offset, offset + length)));
+          offset += (length + 7) & ~7;
+          break;
+        case Types.Blob:
+          columns[c].push(bytes.slice(offset, offset + length));
+          offset += (length + 7) & ~7;
+          break;
+        default:
+          columns[c].push(null);
+          break;
+      }
+    }
+  }
+}
+
+// Collects the values of one column for `Rows.columnar`.
+// Values are kept in a typed array for as long as the
+// column holds only numbers (or only integers, once a
+// value does not fit a number).
+class ColumnBuilder {
+  private _length = 0;
+  private _integers = true;
+  private _floats: Float64Array | null = new Float64Array(64);
+  private _bigints: BigInt64Array | null = null;
+  private _values: any[] | null = null;
+
+  push(value: any) {
+    if (typeof value === "number") {
+      this.pushNumber(value);
+    } else if (typeof value === "bigint") {
+      this.pushBigInt(value);
+    } else {
+      this._toValues().push(value);
+      this._length++;
+    }
+  }
+
+  pushNumber(value: number) {
+    if (this._floats !== null) {
+      if (this._length === this._floats.length) {
+        const floats = new Float64Array(2 * this._length);
+        floats.set(this._floats);
+        this._floats = floats;
+      }
+      this._floats[this._length++] = value;
+      if (!Number.isInteger(value)) {
+        this._integers = false;
+      }
+    } else if (this._bigints !== null && Number.isInteger(value)) {
+      this.pushBigInt(BigInt(value));
+    } else {
+      this._toValues().push(value);
+      this._length++;
+    }
+  }
+
+  pushBigInt(value: bigint) {
+    if (this._floats !== null && this._integers) {
+      // Switch to 64 bit integers
+      this._bigints = new BigInt64Array(this._floats.length);
+      for (let i = 0; i < this._length; i++) {
+        this._bigints[i] = BigInt(this._floats[i]);
+      }
+      this._floats = null;
+    }
+    if (this._bigints !== null) {
+      if (this._length === this._bigints.length) {
+        const bigints = new BigInt64Array(2 * this._length);
+        bigints.set(this._bigints);
+        this._bigints = bigints;
+      }
+      this._bigints[this._length++] = value;
+    } else {
+      this._toValues().push(value);
+      this._length++;
+    }
+  }
+
+  finish(): Float64Array | BigInt64Array | any[] {
+    if (this._floats !== null) {
+      return this._floats.slice(0, this._length);
+    } else if (this._bigints !== null) {
+      return this._bigints.slice(0, this._length);
+    }
+    return this._values!;
+  }
+
+  // Switch to a regular array, integers which fit a
+  // number are converted back to numbers
+  private _toValues(): any[] {
+    if (this._values === null) {
+      const values = new Array(this._length);
+      for (let i = 0; i < this._length; i++) {
+        if (this._floats !== null) {
+          values[i] = this._floats[i];
+        } else {
+          const value = this._bigints![i];
+          values[i] = value <= Number.MAX_SAFE_INTEGER &&
+              value >= Number.MIN_SAFE_INTEGER
+            ? Number(value)
+            : value;
+        }
       }
+      this._values = values;
+      this._floats = null;
+      this._bigints = null;
     }
-    return row;
+    return this._values;
   }
 }
 
@@ -1,21 +1,92 @@
 import SqliteError from "./error.ts";
 
-// Move string to C
+// Strings are moved to C through a scratch arena,
+// one arena is kept per WASM instance. Strings which
+// do not fit are moved using malloc/ free instead.
+const ARENA_MIN_SIZE = 1 << 12;
+const ARENA_MAX_SIZE = 1 << 20;
+
+interface Arena {
+  ptr: number;
+  size: number;
+  top: number;
+}
+
+const arenas: WeakMap<any, Arena> = new WeakMap();
+const encoder = new TextEncoder();
+
+// Wrappers made by `countCalls`, mapped to the
+// instance exports they wrap
+const wrapped: WeakMap<any, any> = new WeakMap();
+
+// Wrap the exports of an instance, so every call of
+// an exported function is counted in `counts`
+export function countCalls(exports: any, counts: Map<string, number>): any {
+  const counting: any = { memory: exports.memory };
+  for (const [name, value] of Object.entries(exports)) {
+    if (typeof value === "function") {
+      const fn = value as (...args: any[]) => any;
+      counting[name] = (...args: any[]) => {
+        counts.set(name, (counts.get(name) ?? 0) + 1);
+        return fn(...args);
+      };
+    }
+  }
+  wrapped.set(counting, exports);
+  return counting;
+}
+
+// Move string to C, the closure receives a pointer
+// to the \0 terminated string and its length in bytes
 export function setStr(
   wasm: any,
   str: string,
-  closure: (ptr: number) => void,
+  closure: (ptr: number, len: number) => void,
 ) {
-  const bytes = new TextEncoder().encode(str);
-  const ptr = wasm.malloc(bytes.length + 1);
+  // The arena belongs to the instance, and its
+  // allocations are not counted as calls
+  wasm = wrapped.get(wasm) ?? wasm;
+  let arena = arenas.get(wasm);
+  if (arena === undefined) {
+    arena = { ptr: 0, size: 0, top: 0 };
+    arenas.set(wasm, arena);
+  }
+
+  // UTF-8 needs at most 3 bytes per UTF-16 code unit
+  const max = 3 * str.length + 1;
+  if (arena.top === 0 && max > arena.size && max <= ARENA_MAX_SIZE) {
+    // Grow arena, only if no pointers into it are in use
+    let size = Math.max(arena.size, ARENA_MIN_SIZE);
+    while (size < max) size *= 2;
+    wasm.free(arena.ptr);
+    arena.ptr = wasm.malloc(size);
+    arena.size = arena.ptr === 0 ? 0 : size;
+  }
+
+  const owned = arena.top + max > arena.size;
+  const ptr = owned ? wasm.malloc(max) : arena.ptr + arena.top;
   if (ptr === 0) {
     throw new SqliteError("Out of memory.");
   }
-  const mem = new Uint8Array(wasm.memory.buffer, ptr, bytes.length + 1);
-  mem.set(bytes);
-  mem[bytes.length] = 0; // \0 terminator
-  closure(ptr);
-  wasm.free(ptr);
+  const { written } = encoder.encodeInto(
+    str,
+    new Uint8Array(wasm.memory.buffer, ptr, max - 1),
+  );
+  new Uint8Array(wasm.memory.buffer)[ptr + written!] = 0; // \0 terminator
+
+  const top = arena.top;
+  if (!owned) {
+    arena.top += written! + 1;
+  }
+  try {
+    closure(ptr, written!);
+  } finally {
+    if (owned) {
+      wasm.free(ptr);
+    } else {
+      arena.top = top;
+    }
+  }
 }
 
 // Move Uint8Array to C
@@ -34,12 +105,32 @@ export function setArr(
   wasm.free(ptr);
 }
 
+// Copy Uint8Array to C, the returned
+// pointer must be freed by the caller
+export function copyArr(wasm: any, arr: Uint8Array): number {
+  const ptr = wasm.malloc(arr.length);
+  if (ptr === 0) {
+    throw new SqliteError("Out of memory.");
+  }
+  new Uint8Array(wasm.memory.buffer, ptr, arr.length).set(arr);
+  return ptr;
+}
+
+// Shared decoder for strings read from C
+const decoder = new TextDecoder();
+
 // Read string from C
 export function getStr(wasm: any, ptr: number): string {
-  const len = wasm.str_len(ptr);
-  const bytes = new Uint8Array(wasm.memory.buffer, ptr, len);
+  const mem = new Uint8Array(wasm.memory.buffer);
+  const len = mem.indexOf(0, ptr) - ptr;
+  return decodeStr(mem.subarray(ptr, ptr + len));
+}
+
+// Decode UTF-8 bytes into a string
+export function decodeStr(bytes: Uint8Array): string {
+  const len = bytes.length;
   if (len > 16) {
-    return new TextDecoder().decode(bytes);
+    return decoder.decode(bytes);
   } else {
     // This optimization is lifted from EMSCRIPTEN's glue code
     let str = "";
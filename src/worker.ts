@@ -0,0 +1,50 @@
+// Worker script used by AsyncDB, each worker
+// holds a single database connection.
+import { DB } from "./db.ts";
+import { setLockTable } from "../build/vfs.js";
+
+// Rows are sent back to the main thread in
+// batches of this size
+const BATCH_ROWS = 512;
+
+const worker = self as any;
+let db: DB | null = null;
+
+worker.onmessage = (event: MessageEvent) => {
+  const { id, op } = event.data;
+  try {
+    switch (op) {
+      case "open":
+        setLockTable(event.data.locks);
+        db = new DB(event.data.path, event.data.readonly);
+        worker.postMessage({ id, rows: [], done: true });
+        break;
+      case "query": {
+        let batch = [];
+        for (const row of db!.query(event.data.sql, event.data.values)) {
+          batch.push(row);
+          if (batch.length === BATCH_ROWS) {
+            worker.postMessage({ id, rows: batch, done: false });
+            batch = [];
+          }
+        }
+        worker.postMessage({ id, rows: batch, done: true });
+        break;
+      }
+      case "busyTimeout":
+        db!.busyTimeout(event.data.ms);
+        worker.postMessage({ id, rows: [], done: true });
+        break;
+      case "close":
+        db?.close(true);
+        worker.postMessage({ id, rows: [], done: true });
+        worker.close();
+        break;
+    }
+  } catch (error) {
+    worker.postMessage({
+      id,
+      error: { message: error.message, code: error.code },
+    });
+  }
+};
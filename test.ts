@@ -4,7 +4,7 @@ import {
   assertMatch,
   assertThrows,
 } from "https://deno.land/std@0.53.0/testing/asserts.ts";
-import { DB, Empty, Status } from "./mod.ts";
+import { AsyncDB, DB, Empty, Status } from "./mod.ts";
 import SqliteError from "./src/error.ts";
 
 // file used for fs io tests
@@ -195,7 +195,13 @@ Deno.test("bindValues", function () {
   db.query(
     "CREATE TABLE bigints (id INTEGER PRIMARY KEY AUTOINCREMENT, val INTEGER)",
   );
-  const int_vals: (bigint | number)[] = [9007199254741991n, 100n];
+  const int_vals: (bigint | number)[] = [
+    9007199254741991n,
+    100n,
+    -9007199254741991n,
+    9223372036854775807n,
+    -9223372036854775808n,
+  ];
   for (const val of int_vals) {
     db.query(
       "INSERT INTO bigints (val) VALUES (?)",
@@ -205,6 +211,13 @@ Deno.test("bindValues", function () {
   rows = [...db.query("SELECT val FROM bigints")].map(([v]) => v);
   int_vals[1] = 100;
   assertEquals(rows, int_vals);
+  // out of range values are rejected instead of wrapping around
+  for (const val of [9223372036854775808n, -9223372036854775809n]) {
+    assertThrows(
+      () => db.query("INSERT INTO bigints (val) VALUES (?)", [val]),
+      SqliteError,
+    );
+  }
 
   // null & undefined
   db.query(
@@ -627,3 +640,854 @@ Deno.test("lastInsertedId", function () {
   // will be resetted to 0 again
   assertEquals(db.lastInsertRowId, 0);
 });
+
+Deno.test("preparedQuery", function () {
+  const db = new DB();
+  db.query(
+    "CREATE TABLE test (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT)",
+  );
+
+  const names = ["Peter Parker", "Clark Kent", "Bruce Wane"];
+  const insert = db.prepareQuery("INSERT INTO test (name) VALUES (:name)");
+  for (const name of names) {
+    assertEquals(insert.query({ name }), Empty);
+  }
+  insert.finalize();
+
+  const select = db.prepareQuery("SELECT name FROM test WHERE id = ?");
+  for (let id = 1; id <= names.length; id++) {
+    const [[name]] = [...select.query([id])];
+    assertEquals(name, names[id - 1]);
+  }
+  // Bindings from the previous run are cleared
+  assertEquals(select.query(), Empty);
+
+  // Only one set of open rows per query
+  const rows = select.query([1]);
+  assertThrows(() => select.query([2]));
+  rows.done();
+  select.query([2]).done();
+
+  select.finalize();
+  assertThrows(() => select.query([1]));
+
+  db.close();
+});
+
+Deno.test("cachedQueryWithOpenRows", function () {
+  const db = new DB();
+  db.query("CREATE TABLE test (id INTEGER)");
+  for (let id = 0; id < 3; id++) {
+    db.query("INSERT INTO test (id) VALUES (?)", [id]);
+  }
+
+  // The same SQL can be run while rows from it are still open
+  const outer = [];
+  for (const [a] of db.query("SELECT id FROM test")) {
+    const inner = [...db.query("SELECT id FROM test")].map(([b]) => b);
+    assertEquals(inner, [0, 1, 2]);
+    outer.push(a);
+  }
+  assertEquals(outer, [0, 1, 2]);
+
+  db.close();
+});
+
+Deno.test("closeFinalizesPreparedQueries", function () {
+  const db = new DB();
+  db.query("CREATE TABLE test (id INTEGER)");
+  const query = db.prepareQuery("SELECT id FROM test");
+  db.close();
+
+  assertThrows(() => query.query());
+  query.finalize();
+});
+
+Deno.test("largeResultsAreRead", function () {
+  const db = new DB();
+  db.query(
+    "CREATE TABLE test (id INTEGER PRIMARY KEY, val REAL, big INTEGER, name TEXT, data BLOB)",
+  );
+  const count = 2000;
+  for (let id = 1; id <= count; id++) {
+    db.query(
+      "INSERT INTO test (id, val, big, name, data) VALUES (?, ?, ?, ?, ?)",
+      [
+        id,
+        id / 4,
+        9007199254740991n + BigInt(id),
+        id % 3 ? `name ${id} ünïcödé` : null,
+        new Uint8Array([id % 256, 1, 2]),
+      ],
+    );
+  }
+
+  let id = 0;
+  for (const [a, val, big, name, data] of db.query("SELECT * FROM test")) {
+    id++;
+    assertEquals(a, id);
+    assertEquals(val, id / 4);
+    assertEquals(big, 9007199254740991n + BigInt(id));
+    assertEquals(name, id % 3 ? `name ${id} ünïcödé` : null);
+    assertEquals(data, new Uint8Array([id % 256, 1, 2]));
+  }
+  assertEquals(id, count);
+
+  db.close();
+});
+
+Deno.test("columnarResults", function () {
+  const db = new DB();
+  db.query("CREATE TABLE test (id INTEGER, val REAL, big INTEGER, name TEXT)");
+  for (let id = 0; id < 100; id++) {
+    db.query("INSERT INTO test VALUES (?, ?, ?, ?)", [
+      id,
+      id / 2,
+      id ? BigInt(id) : 9007199254740992n,
+      `${id}`,
+    ]);
+  }
+
+  const [ids, vals, bigs, names] = db.query("SELECT * FROM test").columnar();
+  assert(ids instanceof Float64Array);
+  assert(vals instanceof Float64Array);
+  assert(bigs instanceof BigInt64Array);
+  assert(Array.isArray(names));
+  assertEquals(ids.length, 100);
+  assertEquals(vals[99], 99 / 2);
+  assertEquals(bigs[0], 9007199254740992n);
+  assertEquals(bigs[99], 99n);
+  assertEquals(names[42], "42");
+
+  // Rows which were already read are not returned again
+  const rows = db.query("SELECT id, val FROM test");
+  for (let i = 0; i < 10; i++) {
+    rows.next();
+  }
+  const [restIds, restVals] = rows.columnar();
+  assert(restIds instanceof Float64Array);
+  assertEquals(restIds.length, 90);
+  assertEquals(restIds[0], 10);
+  assertEquals(restVals[89], 99 / 2);
+
+  // Columns with mixed values are regular arrays
+  db.query("INSERT INTO test VALUES (?, ?, ?, ?)", [
+    "text",
+    2n ** 60n,
+    null,
+    4,
+  ]);
+  const [mixedIds, mixedVals, mixedBigs, mixedNames] = db.query(
+    "SELECT * FROM test",
+  ).columnar();
+  assertEquals(mixedIds.length, 101);
+  assertEquals(mixedIds[0], 0);
+  assertEquals(mixedIds[100], "text");
+  // REAL affinity stores the bigint as a float
+  assert(mixedVals instanceof Float64Array);
+  assertEquals(mixedVals[100], 2 ** 60);
+  assertEquals(mixedBigs[0], 9007199254740992n);
+  assertEquals(mixedBigs[1], 1);
+  assertEquals(mixedBigs[100], null);
+  assertEquals(mixedNames[100], "4");
+
+  assertEquals(Empty.columnar(), []);
+
+  db.close();
+});
+
+Deno.test({
+  name: "largeFileDB",
+  ignore: !permRead || !permWrite,
+  fn: async function () {
+    try {
+      await Deno.remove(testDbFile);
+    } catch {}
+
+    // Write more data than fits in the VFS cache
+    const db = new DB(testDbFile);
+    db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, data BLOB)");
+    const data = new Uint8Array(64 * 1024).map((_, i) => i % 251);
+    db.query("BEGIN");
+    for (let id = 0; id < 64; id++) {
+      db.query("INSERT INTO test (id, data) VALUES (?, ?)", [id, data]);
+    }
+    db.query("COMMIT");
+
+    // Rolled back changes are not visible
+    db.query("BEGIN");
+    db.query("DELETE FROM test");
+    db.query("ROLLBACK");
+
+    const db2 = new DB(testDbFile);
+    let count = 0;
+    for (const [id, blob] of db2.query("SELECT id, data FROM test")) {
+      assertEquals(id, count++);
+      assertEquals(blob, data);
+    }
+    assertEquals(count, 64);
+
+    // Changes from one connection are seen by the other
+    db.query("DELETE FROM test WHERE id >= 32");
+    assertEquals([...db2.query("SELECT COUNT(*) FROM test")], [[32]]);
+
+    db.close();
+    db2.close();
+    await Deno.remove(testDbFile);
+  },
+});
+
+Deno.test({
+  name: "walMode",
+  ignore: !permRead || !permWrite,
+  fn: async function () {
+    try {
+      await Deno.remove(testDbFile);
+    } catch {}
+
+    const db = new DB(testDbFile);
+    assertEquals([...db.query("PRAGMA journal_mode = WAL")], [["wal"]]);
+    db.autoCheckpoint(0);
+    db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, name TEXT)");
+    for (let id = 0; id < 100; id++) {
+      db.query("INSERT INTO test (id, name) VALUES (?, ?)", [id, `${id}`]);
+    }
+    assertEquals([...db.query("SELECT COUNT(*) FROM test")], [[100]]);
+    db.checkpoint("truncate");
+    assertThrows(() => db.checkpoint("not a mode" as any));
+    db.close();
+
+    // Data is in the database file once it is closed
+    const db2 = new DB(testDbFile);
+    assertEquals([...db2.query("SELECT name FROM test WHERE id = 42")], [[
+      "42",
+    ]]);
+
+    // Other connections are refused while the WAL is in use
+    const db3 = new DB(testDbFile);
+    db3.busyTimeout(0);
+    let error;
+    try {
+      db3.query("SELECT COUNT(*) FROM test");
+    } catch (e) {
+      error = e;
+    }
+    assert(error instanceof SqliteError);
+    assertEquals(error.code, Status.SqliteBusy);
+    db2.query("DELETE FROM test WHERE id >= 50");
+    db2.close();
+    assertEquals([...db3.query("SELECT COUNT(*) FROM test")], [[50]]);
+    db3.close();
+    assertThrows(() => db3.busyTimeout(100));
+
+    await Deno.remove(testDbFile);
+  },
+});
+
+Deno.test({
+  name: "lockSlotCollisions",
+  ignore: !permRead || !permWrite,
+  fn: async function () {
+    // Find a file which hashes to the same lock slot
+    // as the test file (see `acquireSlot` in build/vfs.js)
+    const slot = (path: string) => {
+      let hash = 2166136261;
+      for (let i = 0; i < path.length; i++) {
+        hash = Math.imul(hash ^ path.charCodeAt(i), 16777619);
+      }
+      return (hash >>> 0) % 1024;
+    };
+    const dir = Deno.realPathSync(".");
+    const target = slot(`${dir}/${testDbFile}`);
+    let other = "";
+    for (let i = 0; other === ""; i++) {
+      if (slot(`${dir}/collide${i}.db`) === target) {
+        other = `collide${i}.db`;
+      }
+    }
+    for (const path of [testDbFile, other]) {
+      try {
+        await Deno.remove(path);
+      } catch {}
+    }
+
+    // A WAL connection does not block the other file
+    const db = new DB(testDbFile);
+    assertEquals([...db.query("PRAGMA journal_mode = WAL")], [["wal"]]);
+    db.query("CREATE TABLE test (id INTEGER PRIMARY KEY)");
+    const db2 = new DB(other);
+    db2.busyTimeout(0);
+    db2.query("CREATE TABLE test (id INTEGER PRIMARY KEY)");
+    db2.query("INSERT INTO test (id) VALUES (1)");
+    assertEquals([...db2.query("SELECT COUNT(*) FROM test")], [[1]]);
+
+    // Nor do locks held on it
+    db.query("BEGIN EXCLUSIVE");
+    db2.query("INSERT INTO test (id) VALUES (2)");
+    db.query("COMMIT");
+
+    db.close();
+    db2.close();
+    await Deno.remove(testDbFile);
+    await Deno.remove(other);
+  },
+});
+
+Deno.test("executeMany", function () {
+  const db = new DB();
+  db.query(
+    "CREATE TABLE test (id INTEGER PRIMARY KEY, name TEXT, val REAL, big INTEGER, data BLOB, flag INTEGER, date TEXT)",
+  );
+
+  const date = new Date();
+  const rows = [];
+  for (let id = 0; id < 5000; id++) {
+    rows.push([
+      id,
+      `name ${id} ünïcödé`,
+      id / 8,
+      9007199254740991n * BigInt(id % 2 ? 1 : -1),
+      new Uint8Array([id % 256]),
+      id % 2 === 0,
+      date,
+    ]);
+  }
+  rows.push([5000]);
+  db.executeMany(
+    "INSERT INTO test (id, name, val, big, data, flag, date) VALUES (?, ?, ?, ?, ?, ?, ?)",
+    rows,
+  );
+
+  const result = [...db.query("SELECT * FROM test ORDER BY id")];
+  assertEquals(result.length, 5001);
+  assertEquals(result[42], [
+    42,
+    "name 42 ünïcödé",
+    42 / 8,
+    -9007199254740991n,
+    new Uint8Array([42]),
+    1,
+    date.toISOString(),
+  ]);
+  assertEquals(result[5000], [5000, null, null, null, null, null, null]);
+
+  // Failing rows roll back the whole batch
+  assertThrows(() =>
+    db.executeMany("INSERT INTO test (id) VALUES (?)", [[6000], [42]])
+  );
+  assertThrows(() =>
+    db.executeMany("INSERT INTO test (id) VALUES (?)", [[6001], [{}]] as any)
+  );
+  assertThrows(
+    () =>
+      db.executeMany("INSERT INTO test (id, big) VALUES (?, ?)", [
+        [6002, 2n ** 64n],
+      ]),
+    SqliteError,
+  );
+  // The original error is raised, if SQLite already rolled back
+  assertThrows(
+    () =>
+      db.executeMany("INSERT OR ROLLBACK INTO test (id) VALUES (?)", [
+        [6003],
+        [42],
+      ]),
+    SqliteError,
+    "UNIQUE constraint failed",
+  );
+  assertEquals([...db.query("SELECT COUNT(*) FROM test")], [[5001]]);
+
+  db.close();
+});
+
+Deno.test("executeColumns", function () {
+  const db = new DB();
+  db.query("CREATE TABLE test (x REAL, y INTEGER, name TEXT)");
+
+  const xs = new Float64Array(1000).map((_, i) => i / 2);
+  const ys = new BigInt64Array(1000).map((_, i) => BigInt(i));
+  const names = [...xs].map((x) => `${x}`);
+  db.executeColumns("INSERT INTO test (x, y, name) VALUES (?, ?, ?)", [
+    xs,
+    ys,
+    names,
+  ]);
+
+  const [x, y, name] = db.query("SELECT x, y, name FROM test").columnar();
+  assertEquals(x, xs);
+  assertEquals(y, new Float64Array(1000).map((_, i) => i));
+  assertEquals(name, names);
+
+  assertThrows(() =>
+    db.executeColumns("INSERT INTO test (x, y) VALUES (?, ?)", [[1], []])
+  );
+
+  db.close();
+});
+
+Deno.test("blobHandle", function () {
+  const db = new DB();
+  db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, data BLOB)");
+  const size = 200_000;
+  db.query("INSERT INTO test (id, data) VALUES (1, zeroblob(?))", [size]);
+  db.query("INSERT INTO test (id, data) VALUES (2, ?)", [
+    new Uint8Array([1, 2, 3]),
+  ]);
+
+  const data = new Uint8Array(size).map((_, i) => i % 253);
+  const blob = db.openBlob("test", "data", 1, true);
+  assertEquals(blob.length, size);
+  blob.write(data);
+  blob.write(new Uint8Array([42, 42]), 100);
+  data[100] = data[101] = 42;
+
+  const buffer = new Uint8Array(1000);
+  blob.readInto(buffer, 99_000);
+  assertEquals(buffer, data.subarray(99_000, 100_000));
+  assertEquals(blob.read(), data);
+  assertThrows(() => blob.read(size - 1, 2));
+
+  blob.reopen(2);
+  assertEquals(blob.read(), new Uint8Array([1, 2, 3]));
+  blob.close();
+  assertThrows(() => blob.read());
+
+  const [[stored]] = [...db.query("SELECT data FROM test WHERE id = 1")];
+  assertEquals(stored, data);
+
+  // Read only handles can not write
+  const readOnly = db.openBlob("test", "data", 2);
+  assertThrows(() => readOnly.write(new Uint8Array([0])));
+
+  // Open handles block closing
+  assertThrows(() => db.close());
+  db.close(true);
+});
+
+Deno.test({
+  name: "fileLocks",
+  ignore: !permRead || !permWrite,
+  fn: async function () {
+    try {
+      await Deno.remove(testDbFile);
+    } catch {}
+
+    const db = new DB(testDbFile);
+    db.query("CREATE TABLE test (id INTEGER)");
+    db.query("INSERT INTO test (id) VALUES (1)");
+
+    const db2 = new DB(testDbFile);
+    db.query("BEGIN EXCLUSIVE");
+    const e = assertThrows(() =>
+      db2.query("SELECT id FROM test")
+    ) as SqliteError;
+    assertEquals(e.code, Status.SqliteBusy);
+    db.query("COMMIT");
+    assertEquals([...db2.query("SELECT id FROM test")], [[1]]);
+
+    // Read-only connections can not write
+    const reader = new DB(testDbFile, true);
+    assertEquals([...reader.query("SELECT id FROM test")], [[1]]);
+    assertThrows(() => reader.query("INSERT INTO test (id) VALUES (2)"));
+
+    db.close();
+    db2.close();
+    reader.close();
+    await Deno.remove(testDbFile);
+  },
+});
+
+Deno.test({
+  name: "asyncDB",
+  ignore: !permRead || !permWrite,
+  fn: async function () {
+    try {
+      await Deno.remove(testDbFile);
+    } catch {}
+
+    const db = new AsyncDB(testDbFile, 2);
+    await db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, name TEXT)");
+    const inserts = [];
+    for (let id = 0; id < 100; id++) {
+      inserts.push(
+        db.query("INSERT INTO test (id, name) VALUES (?, ?)", [id, `${id}`]),
+      );
+    }
+    await Promise.all(inserts);
+
+    const rows = await db.query("SELECT id, name FROM test");
+    assertEquals(rows.length, 100);
+    const counts = await Promise.all(
+      [1, 2, 3, 4].map(() => db.read("SELECT COUNT(*) FROM test")),
+    );
+    assertEquals(counts, [[[100]], [[100]], [[100]], [[100]]]);
+
+    // Concurrent reads are spread over the readers
+    const reads = [1, 2, 3, 4].map(() => db.read("SELECT COUNT(*) FROM test"));
+    assertEquals(
+      (db as any)._readers.map((reader: any) => reader.pending),
+      [2, 2],
+    );
+    await Promise.all(reads);
+
+    let error;
+    try {
+      await db.read("INSERT INTO test (id) VALUES (1000)");
+    } catch (e) {
+      error = e;
+    }
+    assert(error instanceof SqliteError);
+
+    // Streamed rows arrive in batches
+    await db.query(
+      "WITH RECURSIVE ids(id) AS (SELECT 100 UNION ALL SELECT id + 1 FROM ids WHERE id < 2099) INSERT INTO test (id, name) SELECT id, id FROM ids",
+    );
+    let batches = 0;
+    let streamed = 0;
+    for await (const batch of db.stream("SELECT id FROM test ORDER BY id")) {
+      assertEquals(batch[0][0], streamed);
+      batches++;
+      streamed += batch.length;
+    }
+    assertEquals(streamed, 2100);
+    assert(batches > 1);
+    error = undefined;
+    try {
+      for await (const _ of db.stream("SELECT * FROM missing")) {
+        continue;
+      }
+    } catch (e) {
+      error = e;
+    }
+    assert(error instanceof SqliteError);
+
+    await db.busyTimeout(1000);
+    await db.close();
+    error = undefined;
+    try {
+      await db.busyTimeout(1000);
+    } catch (e) {
+      error = e;
+    }
+    assert(error instanceof SqliteError);
+
+    // Workers are stopped, even if opening fails
+    const failed = new AsyncDB("missing/directory/test.db");
+    error = undefined;
+    try {
+      await failed.query("SELECT 1");
+    } catch (e) {
+      error = e;
+    }
+    assert(error instanceof SqliteError);
+    await failed.close();
+    await Deno.remove(testDbFile);
+  },
+});
+
+Deno.test("stringMarshalling", function () {
+  const db = new DB();
+  db.query("CREATE TABLE strings (id INTEGER PRIMARY KEY, val TEXT)");
+
+  // Strings of varying size, including ones larger
+  // than the scratch arena and multi-byte characters
+  const vals = [
+    "",
+    "a",
+    "😀 € ü",
+    "x".repeat(5000),
+    "€".repeat(1 << 19),
+    "y".repeat(2 << 20),
+  ];
+  for (const val of vals) {
+    db.query("INSERT INTO strings (val) VALUES (?)", [val]);
+  }
+  const rows = [...db.query("SELECT val FROM strings ORDER BY id")].map((
+    [v],
+  ) => v);
+  assertEquals(rows, vals);
+
+  // Named parameters, SQL and values all use the arena
+  const [[match]] = db.query(
+    "SELECT val FROM strings WHERE val = :val AND id > :id",
+    { val: "😀 € ü", id: 0 },
+  );
+  assertEquals(match, "😀 € ü");
+
+  db.close();
+});
+
+Deno.test("memoryStats", function () {
+  const db = new DB();
+  const before = db.memoryStats();
+  assert(before.memoryUsed > 0);
+  assert(before.memoryHighwater >= before.memoryUsed);
+
+  db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, val TEXT)");
+  db.executeMany(
+    "INSERT INTO test (val) VALUES (?)",
+    [...Array(1000)].map((_, i) => [`${i}`.repeat(10)]),
+  );
+  [...db.query("SELECT * FROM test")];
+
+  const after = db.memoryStats(true);
+  assert(after.cacheUsed > 0);
+  assert(after.schemaUsed > 0);
+  assert(after.memoryHighwater >= after.memoryUsed);
+  assert(after.mallocCount > 0);
+
+  // Counters are reset
+  const reset = db.memoryStats();
+  assertEquals(reset.cacheHits, 0);
+  assertEquals(reset.cacheMisses, 0);
+  assert(reset.memoryHighwater <= after.memoryHighwater);
+
+  db.close();
+  assertThrows(() => db.memoryStats());
+
+  // Lookaside memory can be configured at runtime
+  const tuned = new DB();
+  tuned.lookaside(256, 100);
+  tuned.query("CREATE TABLE test (id INTEGER PRIMARY KEY, val TEXT)");
+  assert(tuned.memoryStats().lookasideHighwater > 0);
+  tuned.close();
+  assertThrows(() => tuned.lookaside(256, 100));
+});
+
+Deno.test({
+  name: "serializeDeserialize",
+  ignore: !permWrite || !permRead,
+  fn: function () {
+    const db = new DB();
+    db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, val TEXT)");
+    db.executeMany(
+      "INSERT INTO test (val) VALUES (?)",
+      [...Array(1000)].map((_, i) => [`value ${i}`]),
+    );
+    const image = db.serialize();
+    assertEquals(image.length % 4096, 0);
+    assertEquals(
+      new TextDecoder().decode(image.subarray(0, 15)),
+      "SQLite format 3",
+    );
+    db.close();
+
+    // Load into a new in-memory database, which can grow
+    const copy = new DB();
+    copy.deserialize(image);
+    assertEquals([...copy.query("SELECT COUNT(*) FROM test")], [[1000]]);
+    copy.query("INSERT INTO test (val) VALUES (?)", ["x".repeat(1 << 16)]);
+    assertEquals([...copy.query("SELECT COUNT(*) FROM test")], [[1001]]);
+
+    // Serializing a deserialized database
+    const image2 = copy.serialize();
+    assert(image2.length > image.length);
+    copy.close();
+
+    // Snapshots can be written and loaded as files
+    try {
+      Deno.removeSync(testDbFile);
+    } catch {
+      /* no op */
+    }
+    Deno.writeFileSync(testDbFile, image2);
+    const fileDb = new DB(testDbFile);
+    assertEquals([...fileDb.query("SELECT COUNT(*) FROM test")], [[1001]]);
+    assertEquals(fileDb.serialize(), image2);
+    fileDb.close();
+    Deno.removeSync(testDbFile);
+
+    // Read-only images can not be changed
+    const readonly = new DB();
+    readonly.deserialize(image2, true);
+    assertEquals([...readonly.query("SELECT COUNT(*) FROM test")], [[1001]]);
+    assertThrows(() => readonly.query("DELETE FROM test"));
+
+    // Fails while rows are open
+    const rows = readonly.query("SELECT * FROM test");
+    assertThrows(() => readonly.deserialize(image));
+    rows.done();
+    readonly.deserialize(image);
+    assertEquals([...readonly.query("SELECT COUNT(*) FROM test")], [[1000]]);
+    readonly.close();
+
+    // Failed loads do not leak the image
+    const failing = new DB();
+    const used = failing.memoryStats().memoryUsed;
+    for (let i = 0; i < 10; i++) {
+      assertThrows(() => failing.deserialize(image, false, "missing"));
+    }
+    assert(failing.memoryStats().memoryUsed < used + image.length);
+    failing.close();
+
+    // Empty databases have empty images
+    const empty = new DB();
+    assertEquals(empty.serialize(), new Uint8Array(0));
+    empty.deserialize(new Uint8Array(0));
+    empty.query("CREATE TABLE test (id INTEGER PRIMARY KEY)");
+    empty.close();
+
+    // Images of WAL databases use a rollback journal
+    const walDb = new DB(testDbFile);
+    walDb.query("PRAGMA journal_mode = WAL");
+    walDb.query("CREATE TABLE test (id INTEGER PRIMARY KEY, val TEXT)");
+    walDb.query("INSERT INTO test (val) VALUES ('wal')");
+    const walImage = walDb.serialize();
+    assertEquals([walImage[18], walImage[19]], [1, 1]);
+    walDb.close();
+    const walCopy = new DB();
+    walCopy.deserialize(walImage);
+    assertEquals([...walCopy.query("SELECT val FROM test")], [["wal"]]);
+    walCopy.close();
+
+    // Files in WAL mode can be loaded once checkpointed
+    const walFile = Deno.readFileSync(testDbFile);
+    assertEquals(walFile[18], 2);
+    const fileCopy = new DB();
+    fileCopy.deserialize(walFile, true);
+    assertEquals([...fileCopy.query("SELECT val FROM test")], [["wal"]]);
+    fileCopy.close();
+    Deno.removeSync(testDbFile);
+  },
+});
+
+Deno.test({
+  name: "ioStats",
+  ignore: !permWrite || !permRead,
+  fn: function () {
+    try {
+      Deno.removeSync(testDbFile);
+    } catch {
+      /* no op */
+    }
+
+    const db = new DB(testDbFile);
+    db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, val TEXT)");
+    db.executeMany(
+      "INSERT INTO test (val) VALUES (?)",
+      [...Array(1000)].map((_, i) => [`${i}`]),
+    );
+    const written = db.ioStats(true);
+    assert(written.opens >= 1);
+    assert(written.writes > 0);
+    assert(written.writeBytes >= 4096);
+    assert(written.syncs > 0);
+    // I/O is only timed while profiling
+    assertEquals(written.ioTime, 0);
+
+    const reset = db.ioStats();
+    assertEquals(reset.writes, 0);
+    assertEquals(reset.reads, 0);
+
+    [...db.query("SELECT * FROM test")];
+    const read = db.ioStats();
+    assertEquals(read.writes, 0);
+    assert(read.locks > 0);
+
+    db.close();
+    Deno.removeSync(testDbFile);
+  },
+});
+
+Deno.test("profile", function () {
+  const db = new DB();
+  db.query("CREATE TABLE test (id INTEGER PRIMARY KEY, val INTEGER)");
+  db.executeMany(
+    "INSERT INTO test (val) VALUES (?)",
+    [...Array(100)].map((_, i) => [i]),
+  );
+
+  // Nothing is collected unless profiling
+  [...db.query("SELECT * FROM test WHERE val = 1")];
+  assertEquals(db.callStats().size, 0);
+  assertEquals(db.statementStats().size, 0);
+
+  db.profile();
+  const sql = "SELECT * FROM test WHERE val > ?";
+  const rows = db.query(sql, [10]);
+  assert(rows.stats().vmSteps > 0);
+  assertEquals([...rows].length, 89);
+  const stats = rows.stats();
+  assert(stats.fullscanSteps >= 99);
+  assert(stats.vmSteps > 0);
+  [...db.query(sql, [50])];
+
+  const calls = db.callStats(true);
+  assert(calls.get("step_rows")! > 0);
+  assert(calls.get("bind_int")! >= 2);
+  // Strings are moved through the arena, without counted allocations
+  assertEquals(calls.get("malloc"), undefined);
+  assertEquals(db.callStats().size, 0);
+
+  const statementStats = db.statementStats(true);
+  assertEquals(statementStats.get(sql)!.runs, 2);
+  assertEquals(
+    statementStats.get(sql)!.fullscanSteps,
+    2 * stats.fullscanSteps,
+  );
+  assertEquals(db.statementStats().size, 0);
+
+  // Calls are still counted after turning profiling back on
+  db.profile(false);
+  [...db.query(sql, [10])];
+  assertEquals(db.callStats().size, 0);
+  db.profile(true);
+  [...db.query(sql, [10])];
+  assert(db.callStats(true).get("bind_int")! > 0);
+  db.statementStats(true);
+
+  // Sorts are counted
+  [...db.query("SELECT * FROM test ORDER BY val DESC")];
+  assertEquals(
+    db.statementStats().get("SELECT * FROM test ORDER BY val DESC")!.sorts,
+    1,
+  );
+
+  db.profile(false);
+  const done = db.query(sql, [10]);
+  [...done];
+  assertThrows(() => done.stats());
+
+  // Prepared queries add up counters over all runs
+  const query = db.prepareQuery("SELECT * FROM test");
+  [...query.query()];
+  [...query.query()];
+  assert(query.stats().fullscanSteps >= 2 * 99);
+  assertEquals(query.stats(true).runs, 2);
+  assertEquals(query.stats().runs, 0);
+  query.finalize();
+  assertThrows(() => query.stats());
+
+  db.close();
+});
+
+Deno.test("trace", function () {
+  // Tracing is only built in with `make SQLITE_TRACE=1`, the
+  // CI job using such a build sets SQLITE_TRACE for the tests
+  let traceBuild = false;
+  try {
+    traceBuild = Deno.env.get("SQLITE_TRACE") !== undefined;
+  } catch {
+    /* no env permission, assume default build */
+  }
+
+  const db = new DB();
+  const traced: string[] = [];
+  if (!traceBuild) {
+    assertThrows(() => db.trace((sql) => traced.push(sql)), SqliteError);
+    db.close();
+    return;
+  }
+
+  db.trace((sql) => traced.push(sql));
+  db.query("CREATE TABLE test (id INTEGER PRIMARY KEY)");
+  db.query("INSERT INTO test (id) VALUES (?)", [42]);
+  db.trace(null);
+  db.query("SELECT * FROM test");
+  assertEquals(traced, [
+    "CREATE TABLE test (id INTEGER PRIMARY KEY)",
+    "INSERT INTO test (id) VALUES (42)",
+  ]);
+  db.close();
+  assertThrows(() => db.trace(null));
+});